@@ -0,0 +1,437 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdio.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#define FILETYPE_REQ 0xea // file-type request
+#define FILETYPE_RSP 0xe9 // successful file-type response
+#define CHECKSUM_REQ 0xca // file checksum request
+#define CHECKSUM_RSP 0xc9 // successful checksum response
+#define DOWNLOAD_REQ 0xaa // download file request
+#define DOWNLOAD_RSP 0xa9 // successful download response
+#define MAX_PACKET_SIZE 4096 //max size of a packet frame
+#define MAX_LOADS 4096 // max concurrent connections
+#define MAX_THREADS 64
+#define DRAIN_SIZE (1 << 16) // scratch buffer download bodies are read into and thrown away
+#define MIX_FILETYPE 0x01
+#define MIX_CHECKSUM 0x02
+
+//tbench [hostname:]port [-c clients] [-d downloads [-b mbps]] [-p threads] [-t seconds] [-k] [-r filetype|checksum|both] filename [bigfile]
+//clients loop on small FILETYPE_REQ/CHECKSUM_REQ requests for filename while downloads loop on
+//DOWNLOAD_REQ of bigfile, each read at no more than mbps Mbit/s like a slow client;
+//prints the request rate and latency percentiles of the small requests. The connections are
+//spread over -p threads, each with its own epoll loop, so one core does not cap the load
+
+enum LoadState {
+	LOAD_CONNECTING,
+	LOAD_SENDING,
+	LOAD_HEAD,
+	LOAD_BODY
+};
+
+struct Load {
+	struct Bench* bench; // the thread driving the connection
+	int fd;
+	int bulk; // a downloader rather than a small request client
+	enum LoadState state;
+	char req[MAX_PACKET_SIZE];
+	int req_len;
+	int sent;
+	char head[5];
+	int got; // bytes of head received
+	long left; // body bytes still to come
+	long body; // body bytes received
+	int paused; // a download ahead of its -b rate, stepped again from the main loop
+	int type; // request type in flight
+	long long start; // us, connect or send time of the request in flight
+};
+
+// one load generator thread: its connections and what they measured
+struct Bench {
+	pthread_t thread;
+	int epoll_fd;
+	struct Load* loads; // small request clients first, then downloads
+	int clients;
+	int downloads;
+	long* samples; // us, latency of every small request answered
+	long sample_count;
+	long sample_cap;
+	long errors;
+	long downloaded; // complete downloads
+	long long bulk_bytes;
+	int next_small; // alternates the small request types
+	int failed;
+};
+
+long long nowUs();
+void usage();
+int parseArg(int argc, char* argv[]);
+int buildReq(struct Load* load);
+int startLoad(struct Load* load);
+void finishReq(struct Load* load);
+void failLoad(struct Load* load);
+void stepLoad(struct Load* load);
+void* runBench(void* arg);
+int cmpLong(const void* a, const void* b);
+void report(struct Bench* benches, double seconds);
+
+static char hostname[256] = "localhost";
+static int port;
+static struct sockaddr_in server_addr;
+static int clients = 16; // -c
+static int downloads = 0; // -d
+static int threads = 1; // -p
+static double bulk_rate = 0; // -b, bytes/us each download is read at, 0 for as fast as it comes
+static int seconds = 10; // -t
+static int keep_alive = 0; // -k: send the next request on the same connection
+static int mix = MIX_FILETYPE | MIX_CHECKSUM; // -r
+static char filename[256];
+static char bigfile[256];
+static long long deadline; // us, when every thread stops
+
+int main(int argc, char* argv[]) {
+	struct Bench* benches;
+	long long began;
+	int k;
+	if (parseArg(argc, argv)) {
+		usage();
+		return 1;
+	}
+	if (NULL == (benches = (struct Bench*) calloc(threads, sizeof(struct Bench)))) {
+		fprintf(stderr, "fail to allocate the threads!\n");
+		return 1;
+	}
+	began = nowUs();
+	deadline = began + seconds * 1000000LL;
+	for (k = 0; k < threads; ++k) {
+		benches[k].clients = clients / threads + (k < clients % threads);
+		benches[k].downloads = downloads / threads + (k < downloads % threads);
+		if ((errno = pthread_create(&benches[k].thread, NULL, runBench, &benches[k]))) {
+			fprintf(stderr, "fail to start thread %d: %s(errno: %d)\n", k, strerror(errno), errno);
+			return 1;
+		}
+	}
+	for (k = 0; k < threads; ++k) {
+		pthread_join(benches[k].thread, NULL);
+		if (benches[k].failed) {return 1;}
+	}
+	report(benches, (nowUs() - began) / 1e6);
+	return 0;
+}
+/*------------------------------------------------------------------------------*/
+
+long long nowUs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+void usage() {
+	fprintf(stderr, "usage: tbench [hostname:]port [-c clients] [-d downloads [-b mbps]] [-p threads] [-t seconds] [-k] "
+		"[-r filetype|checksum|both] filename [bigfile]\n");
+}
+
+int parseArg(int argc, char* argv[]) {
+	struct hostent* host;
+	char* tmp;
+	int k;
+	if (argc < 3) {return 1;}
+	if ((tmp = strrchr(argv[1], ':'))) {
+		*tmp = '\0';
+		strcpy(hostname, argv[1]);
+		argv[1] = tmp + 1;
+	}
+	if (!(port = atoi(argv[1]))) {return 1;}
+	for (k = 2; k < argc && argv[k][0] == '-'; ++k) {
+		if (strcmp("-k", argv[k]) == 0) {
+			keep_alive = 1;
+		} else if (k + 1 == argc) {
+			return 1;
+		} else if (strcmp("-c", argv[k]) == 0) {
+			clients = atoi(argv[++k]);
+		} else if (strcmp("-d", argv[k]) == 0) {
+			downloads = atoi(argv[++k]);
+		} else if (strcmp("-b", argv[k]) == 0) {
+			bulk_rate = atof(argv[++k]) / 8;
+		} else if (strcmp("-p", argv[k]) == 0) {
+			threads = atoi(argv[++k]);
+		} else if (strcmp("-t", argv[k]) == 0) {
+			seconds = atoi(argv[++k]);
+		} else if (strcmp("-r", argv[k]) == 0) {
+			++k;
+			mix = strcmp("filetype", argv[k]) == 0 ? MIX_FILETYPE : strcmp("checksum", argv[k]) == 0 ? MIX_CHECKSUM
+				: strcmp("both", argv[k]) == 0 ? MIX_FILETYPE | MIX_CHECKSUM : 0;
+		} else {
+			return 1;
+		}
+	}
+	if (k == argc || strlen(argv[k]) >= sizeof(filename) || clients < 1 || downloads < 0
+		|| clients + downloads > MAX_LOADS || threads < 1 || threads > MAX_THREADS || threads > clients
+		|| seconds < 1 || !mix || bulk_rate < 0) {
+		return 1;
+	}
+	strcpy(filename, argv[k++]);
+	if (k < argc) {
+		if (strlen(argv[k]) >= sizeof(bigfile)) {return 1;}
+		strcpy(bigfile, argv[k]);
+	} else if (downloads) {
+		return 1;
+	}
+	if ((host = gethostbyname(hostname)) == NULL) {
+		fprintf(stderr, "fail to get host ip !\n");
+		return 1;
+	}
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_addr.s_addr = *(in_addr_t*) *host->h_addr_list;
+	server_addr.sin_port = htons(port);
+	return 0;
+}
+
+//lay out the next request of the connection in load->req, the way tclient sends it
+int buildReq(struct Load* load) {
+	int len;
+	int val;
+	if (load->bulk) {
+		load->type = DOWNLOAD_REQ;
+	} else if (mix == (MIX_FILETYPE | MIX_CHECKSUM)) {
+		load->type = (load->bench->next_small++ & 1) ? CHECKSUM_REQ : FILETYPE_REQ;
+	} else {
+		load->type = mix == MIX_FILETYPE ? FILETYPE_REQ : CHECKSUM_REQ;
+	}
+	len = strlen(load->bulk ? bigfile : filename);
+	load->req[0] = (char) load->type;
+	if (load->type == FILETYPE_REQ) {
+		val = htonl(len);
+		memcpy(load->req + 1, &val, 4);
+		memcpy(load->req + 5, filename, len);
+		load->req_len = 5 + len;
+	} else {
+		val = htonl(8 + len);
+		memcpy(load->req + 1, &val, 4);
+		val = htonl(0); // offset
+		memcpy(load->req + 5, &val, 4);
+		val = htonl(-1); // length, to the end of the file
+		memcpy(load->req + 9, &val, 4);
+		memcpy(load->req + 13, load->bulk ? bigfile : filename, len);
+		load->req_len = 13 + len;
+	}
+	load->sent = 0;
+	load->got = 0;
+	return 0;
+}
+
+//open a new non-blocking connection for the next request; the request is timed from here
+int startLoad(struct Load* load) {
+	struct epoll_event ev;
+	int one = 1;
+	if ((load->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1) {
+		fprintf(stderr, "socket error: %s(errno: %d)\n", strerror(errno), errno);
+		return 1;
+	}
+	setsockopt(load->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	buildReq(load);
+	load->start = nowUs();
+	load->state = LOAD_SENDING;
+	if (connect(load->fd, (struct sockaddr*) &server_addr, sizeof(server_addr)) == -1) {
+		if (errno != EINPROGRESS) {
+			fprintf(stderr, "fail to connect server: %s(errno: %d)\n", strerror(errno), errno);
+			close(load->fd);
+			return 1;
+		}
+		load->state = LOAD_CONNECTING;
+	}
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+	ev.data.ptr = load;
+	if (epoll_ctl(load->bench->epoll_fd, EPOLL_CTL_ADD, load->fd, &ev) == -1) {
+		fprintf(stderr, "epoll_ctl error: %s(errno: %d)\n", strerror(errno), errno);
+		close(load->fd);
+		return 1;
+	}
+	return 0;
+}
+
+//record a complete response and go on with the next request, on the same connection with -k
+void finishReq(struct Load* load) {
+	struct Bench* bench = load->bench;
+	long* grown;
+	if (load->bulk) {
+		++bench->downloaded;
+	} else {
+		if (bench->sample_count == bench->sample_cap
+			&& NULL != (grown = (long*) realloc(bench->samples, sizeof(long) * bench->sample_cap * 2))) {
+			bench->samples = grown;
+			bench->sample_cap *= 2;
+		}
+		if (bench->sample_count < bench->sample_cap) {bench->samples[bench->sample_count++] = nowUs() - load->start;}
+	}
+	if (keep_alive) {
+		buildReq(load);
+		load->start = nowUs();
+		load->state = LOAD_SENDING;
+	} else {
+		close(load->fd);
+		if (startLoad(load)) {exit(1);}
+	}
+}
+
+//a refused, reset or error response; count it and start over on a fresh connection
+void failLoad(struct Load* load) {
+	++load->bench->errors;
+	close(load->fd);
+	if (startLoad(load)) {exit(1);}
+}
+
+//advance the connection as far as its socket allows
+void stepLoad(struct Load* load) {
+	char drain[DRAIN_SIZE];
+	socklen_t len = sizeof(int);
+	int err = 0, n;
+	for (;;) {
+		switch (load->state) {
+		case LOAD_CONNECTING:
+			if (getsockopt(load->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err) {
+				failLoad(load);
+				return;
+			}
+			load->state = LOAD_SENDING;
+			break;
+		case LOAD_SENDING:
+			if ((n = send(load->fd, load->req + load->sent, load->req_len - load->sent, MSG_NOSIGNAL)) < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK) {return;}
+				failLoad(load);
+				return;
+			}
+			if ((load->sent += n) == load->req_len) {load->state = LOAD_HEAD;}
+			break;
+		case LOAD_HEAD:
+			if ((n = recv(load->fd, load->head + load->got, 5 - load->got, 0)) <= 0) {
+				if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {return;}
+				failLoad(load);
+				return;
+			}
+			if ((load->got += n) < 5) {break;}
+			if ((0xff & load->head[0]) != (load->type == FILETYPE_REQ ? FILETYPE_RSP
+				: load->type == CHECKSUM_REQ ? CHECKSUM_RSP : DOWNLOAD_RSP)) {
+				++load->bench->errors;
+			}
+			memcpy(&n, load->head + 1, 4);
+			load->left = (unsigned int) ntohl(n);
+			load->body = 0;
+			load->state = LOAD_BODY;
+			if (load->left == 0) {
+				finishReq(load);
+				if (!keep_alive) {return;}
+			}
+			break;
+		case LOAD_BODY:
+			if (load->bulk && bulk_rate > 0 && load->body >= bulk_rate * (nowUs() - load->start)) {
+				load->paused = 1;
+				return;
+			}
+			if ((n = recv(load->fd, drain, load->left < DRAIN_SIZE ? load->left : DRAIN_SIZE, 0)) <= 0) {
+				if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {return;}
+				failLoad(load);
+				return;
+			}
+			if (load->bulk) {load->bench->bulk_bytes += n;}
+			load->body += n;
+			if ((load->left -= n) == 0) {
+				finishReq(load);
+				if (!keep_alive) {return;}
+			}
+			break;
+		}
+	}
+}
+
+//drive the connections of one thread until the deadline
+void* runBench(void* arg) {
+	struct Bench* bench = (struct Bench*) arg;
+	struct epoll_event events[64];
+	int k, n, count = bench->clients + bench->downloads;
+	if (NULL == (bench->loads = (struct Load*) calloc(count, sizeof(struct Load)))
+		|| NULL == (bench->samples = (long*) malloc(sizeof(long) * (bench->sample_cap = 1 << 16)))) {
+		fprintf(stderr, "fail to allocate the connections!\n");
+		bench->failed = 1;
+		return NULL;
+	}
+	if ((bench->epoll_fd = epoll_create1(0)) == -1) {
+		fprintf(stderr, "epoll_create1 error: %s(errno: %d)\n", strerror(errno), errno);
+		bench->failed = 1;
+		return NULL;
+	}
+	for (k = 0; k < count; ++k) {
+		bench->loads[k].bench = bench;
+		bench->loads[k].bulk = k >= bench->clients;
+		if (startLoad(&bench->loads[k])) {
+			bench->failed = 1;
+			return NULL;
+		}
+	}
+	while (nowUs() < deadline) {
+		if ((n = epoll_wait(bench->epoll_fd, events, 64, 10)) == -1 && errno != EINTR) {
+			fprintf(stderr, "epoll_wait error: %s(errno: %d)\n", strerror(errno), errno);
+			bench->failed = 1;
+			return NULL;
+		}
+		for (k = 0; k < n; ++k) {
+			stepLoad((struct Load*) events[k].data.ptr);
+		}
+		for (k = bench->clients; k < count; ++k) {
+			if (bench->loads[k].paused) {
+				bench->loads[k].paused = 0;
+				stepLoad(&bench->loads[k]);
+			}
+		}
+	}
+	return NULL;
+}
+
+int cmpLong(const void* a, const void* b) {
+	return *(const long*) a < *(const long*) b ? -1 : *(const long*) a > *(const long*) b;
+}
+
+//merge the measurements of every thread
+void report(struct Bench* benches, double seconds) {
+	long* samples;
+	long sample_count = 0, errors = 0, downloaded = 0;
+	long long bulk_bytes = 0;
+	int k;
+	for (k = 0; k < threads; ++k) {
+		sample_count += benches[k].sample_count;
+	}
+	if (NULL == (samples = (long*) malloc(sizeof(long) * (sample_count + 1)))) {
+		fprintf(stderr, "fail to allocate the samples!\n");
+		return;
+	}
+	for (sample_count = 0, k = 0; k < threads; ++k) {
+		memcpy(samples + sample_count, benches[k].samples, sizeof(long) * benches[k].sample_count);
+		sample_count += benches[k].sample_count;
+		errors += benches[k].errors;
+		downloaded += benches[k].downloaded;
+		bulk_bytes += benches[k].bulk_bytes;
+	}
+	qsort(samples, sample_count, sizeof(long), cmpLong);
+	fprintf(stdout, "small requests: %ld in %.1f s (%.0f/s), %ld errors\n", sample_count, seconds,
+		sample_count / seconds, errors);
+	if (sample_count) {
+		fprintf(stdout, "latency ms: p50 %.2f p90 %.2f p99 %.2f p99.9 %.2f max %.2f\n", samples[sample_count / 2] / 1e3,
+			samples[sample_count * 9 / 10] / 1e3, samples[sample_count * 99 / 100] / 1e3,
+			samples[sample_count * 999 / 1000] / 1e3, samples[sample_count - 1] / 1e3);
+	}
+	if (downloads) {
+		fprintf(stdout, "downloads: %ld complete, %.1f MB/s\n", downloaded, bulk_bytes / seconds / 1e6);
+	}
+	free(samples);
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
@@ -7,36 +8,134 @@
 #include <stdio.h>
 #include<netdb.h>
 #include <netinet/in.h>
+#include <netinet/ip.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+#include <zlib.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 #define FILETYPE_REQ 0xea // file-type request
 #define FILETYPE_RSP 0xe9 // successful file-type response
 #define FILETYPE_ERR 0xe8 // failed file-type response
 #define CHECKSUM_REQ 0xca // file checksum request
 #define CHECKSUM_RSP 0xc9 // successful checksum response
 #define CHECKSUM_ERR 0xc8 // failed checksum response
+#define CHECKSUM_AREQ 0xc7 // file checksum request naming the hash algorithm
+#define CHECKSUM_TREE_REQ 0xda // chunked (Merkle tree) checksum request
+#define CHECKSUM_TREE_RSP 0xd9 // successful tree checksum response
+#define CHECKSUM_TREE_ERR 0xd8 // failed tree checksum response
+#define TREE_FLAG_LEAVES 0x01 // CHECKSUM_TREE_REQ flags: send the digest of every chunk after the root
 #define DOWNLOAD_REQ 0xaa // download file request
 #define DOWNLOAD_RSP 0xa9 // successful download response
 #define DOWNLOAD_ERR 0xa8 // failed download response
+#define DOWNLOAD_ZREQ 0xa7 // download file request accepting a compressed body
+#define DOWNLOAD_ZRSP 0xa6 // successful download response with a deflate-compressed body
+#define ZCODEC_DEFLATE 0x01 // DOWNLOAD_ZREQ capability: zlib deflate stream
+#define FILESIZE_REQ 0xba // file size request
+#define FILESIZE_RSP 0xb9 // successful file size response
+#define FILESIZE_ERR 0xb8 // failed file size response
 #define UNKNOWN_FAIL 0x51 // catch-all failure response
 #define MAX_PACKET_SIZE 4096 //max size of a packet frame
 #define PACKET_RESERVE_SIZE 4
+#define DATAGRAM_MIN 1280 // smallest UDP datagram a client asks for, room for any response head
+#define DATAGRAM_MAX 65504 // largest UDP datagram, a multiple of 8 under the IPv4 limit of 65507
+#define IP_UDP_HEADERS 28 // IPv4 and UDP header bytes in front of a datagram
+#define RECV_BATCH 32 // max UDP packets drained by one recvmmsg()
+#define UDP_RCVBUF (4 << 20) // receive buffer of the UDP socket
+#define RECV_RING 1024 // max UDP packets buffered for in-order reassembly, no more bytes than the socket buffer holds
+#define ACK_FLAG_SACK 0x01 // ACK reserved field: the ACK carries a SACK bitmap
+#define ACK_FLAG_NAK 0x02 // ACK reserved field: the packet of this seq arrived corrupted, resend it now
+#define REQ_SIZE_MASK 0x0000fff8 // request reserved field: largest datagram this client accepts
+#define REQ_CAP_FEC 0x00010000 // request reserved field: this client can rebuild packets from XOR parity
+#define REQ_WINDOW_SHIFT 20 // request reserved field: packets this client buffers, from this bit up
+#define PACKET_FLAG_PARITY 0x80 // top byte of a data packet's reserved field: an XOR parity packet
+#define PACKET_FLAG_CRC 0x40 // top byte of a data packet's reserved field: a CRC32C of the packet follows it
+#define REQ_CAP_CRC 0x00020000 // request reserved field: this client checks a CRC32C trailer on every packet
+#define CRC_SIZE 4
+#define CRC32C_POLY 0x82f63b78 // Castagnoli, reflected
+#define INITIAL_SEQ 100001 // sequence number of the first packet of a server response
+#define PIPELINE_DEPTH 32 // max requests in flight on one connection
+#define MAX_OP_ARGS 16
+#define MAX_PARALLEL 64 // max connections of a parallel download
+#define RESUME_CHECK_SIZE (1 << 16) // tail of a partial download compared with the server before resuming
+#define ZFRAME_RAW_MAX (1 << 16) // max uncompressed bytes of one DOWNLOAD_ZRSP frame
+#define ZFRAME_MAX (ZFRAME_RAW_MAX + (ZFRAME_RAW_MAX >> 3) + 1024) // max compressed bytes of one frame
 
 //tclient [hostname:]port filetype [-udp] filename
-//tclient [hostname:]port checksum [-udp] [-o offset] [-l length] filename
-//tclient [hostname:]port download [-udp] [-o offset] [-l length] filename [saveasfilename]
+//tclient [hostname:]port checksum [-udp] [-o offset] [-l length] [-a algorithm] filename
+//tclient [hostname:]port treesum [-udp] [-o offset] [-l length] [-k chunk] [-v] filename [localfile]
+//tclient [hostname:]port download [-udp [-s size] [-V]] [-z] [-o offset] [-l length] [-P connections | -c] filename [saveasfilename]
+//tclient [hostname:]port batch [listfile]
+
+//one request and what to do with its response
+struct Op {
+	int type;
+	char filename[256];
+	int offset;
+	int length;
+	char saveasfilename[256];
+	int parallel; // connections of a download
+	int resume; // continue a partial download
+	int compress; // ask for a compressed download body
+	int chunk; // tree checksum chunk bytes, 0 for the server default
+	int leaves; // print the digest of every chunk of a tree checksum
+	char localfile[256]; // compare a tree checksum chunk by chunk with this file
+	int algo; // CHECKSUM_AREQ hash algorithm, 0 for a plain MD5 CHECKSUM_REQ
+	int digest; // print the MD5 of a UDP download body, hashed as it is written
+};
+
+//hash algorithms a checksum request can name, by their CHECKSUM_AREQ ids
+static const char* hash_names[] = {"", "md5", "sha1", "sha256", "sha512-256", "blake2s", "blake2b"};
 
 /*------------------------------------------------------------------------------*/ 
 void writeInt32(char* buf, int val);
 int readInt32(const char* buf);
 int tsend(const char* src, long length);
+void sendSack();
+void sendNak(int seq);
+uint32_t crc32cSoft(uint32_t crc, const char* buf, size_t len);
+uint32_t crc32cHard(uint32_t crc, const char* buf, size_t len);
+void crc32cInit();
+void xorBytes(char* dst, const char* src, int n);
+int fecRecover(const char* parity, int length);
+int pathMtu(const struct sockaddr_in* addr);
+int recvBatch();
+void ringConsume(int n);
 int trecv(char* dst, long max_length);
 int readData(char* buf, int length);
 int readMsg(char* buf);
 void TCPconnect();
 void UDPconnect();
 void setConnectMode();
-int download(int argc,char* argv[]);
-int checksum(int argc,char* argv[]);
-int filetype(int argc,char* argv[]);
+int download(int argc, char* argv[], struct Op* op);
+int checksum(int argc, char* argv[], struct Op* op);
+int treesum(int argc, char* argv[], struct Op* op);
+int filetype(int argc, char* argv[], struct Op* op);
+int parseOp(const char* command, int argc, char* argv[], struct Op* op);
+int sendOp(const struct Op* op);
+void recvFiletype(const struct Op* op);
+void recvChecksum(const struct Op* op);
+void treeRoot(unsigned char* nodes, int n, unsigned char root[]);
+void recvTreeChecksum(const struct Op* op);
+int recvBody(int fd, off_t pos, int len);
+int recvRingBody(int fd, off_t pos, int len);
+int recvZBody(int fd, off_t pos, int len);
+int recvAnyBody(int type, int fd, off_t pos, int len);
+void recvDownload(const struct Op* op);
+int fileSize(const char* file);
+int parallelDownload(const struct Op* op);
+int localChecksum(const char* file, int offset, int length, unsigned char md5_sum[]);
+int remoteChecksum(const char* file, int offset, int length, unsigned char md5_sum[]);
+int resumeDownload(const struct Op* op);
+void recvOp(const struct Op* op);
+int request(const char* command, int argc, char* argv[]);
+int batch(int argc, char* argv[]);
 
 static char hostname[256] = "localhost";
 static int port;
@@ -44,7 +143,7 @@ static char cmd[256];
 
 int main(int argc,char* argv[]){
 	char* tmp;
-	if (argc < 4) {
+	if (argc < 4 && !(argc == 3 && strcmp("batch", argv[2]) == 0)) {
 		fprintf(stderr, "error: lack enough parameters!");
 		return 1;
 	}
@@ -58,28 +157,33 @@ int main(int argc,char* argv[]){
 		return 1;
 	}
 	strcpy(cmd, argv[2]);
-	if (strcmp("filetype", argv[2]) == 0) {
-		filetype(argc - 3, &argv[3]);
-	} else if (strcmp("checksum", argv[2]) == 0) {
-		checksum(argc - 3, &argv[3]);
-	} else if (strcmp("download", argv[2]) == 0) {
-		download(argc - 3, &argv[3]);
-	} else {
-		fprintf(stderr, "error: illegal command!");
-		return 1;
+	crc32cInit();
+	if (strcmp("batch", argv[2]) == 0) {
+		return batch(argc - 3, &argv[3]);
 	}
-    return 0;
+	return request(argv[2], argc - 3, &argv[3]);
 }
 /*------------------------------------------------------------------------------*/ 
 
 static int udp = 0;
-static char filename[256];
-static int offset = 0;
-static int length = -1;
-static char saveasfilename[256];
 static int sock_fd;
 static struct sockaddr_in server_addr;
 static int packet_seq = 123;
+static int datagram_size = 0; // -s: largest UDP datagram to accept, 0 to fit the path MTU
+static int ring_slots = RECV_RING; // packets in the receive window, as many as UDP_RCVBUF holds
+static char* recv_buf; // ring_slots + RECV_BATCH buffers of datagram_size bytes
+static char* ring[RECV_RING]; // UDP receive window, packet seq is kept in ring[seq % ring_slots]
+static int ring_len[RECV_RING]; // length of the packet in the slot, 0 if not received yet
+static char* stage[RECV_BATCH]; // recvmmsg() buffers, swapped into the ring when accepted
+static int read_seq = INITIAL_SEQ; // next packet to be read
+static int read_off = 0; // payload bytes of read_seq already read
+static int ack_seq = INITIAL_SEQ; // every packet before it has been received
+static int crc_seen = 0; // the response carries CRC32C trailers, a packet without one is corrupted
+static long crc_failures = 0; // packets dropped and NAKed because of a CRC32C mismatch
+static uint32_t crc32c_table[256];
+static uint32_t (*crc32cUpdate)(uint32_t crc, const char* buf, size_t len) = crc32cSoft;
+static EVP_MD_CTX* body_md5 = NULL; // MD5 of the body bytes written in order, when body_hashing
+static int body_hashing = 0;
 
 void writeInt32(char* buf, int val) {
 	memcpy(buf, (const char*) &val, 4);
@@ -95,7 +199,12 @@ int tsend(const char* src, long length) {
 	char packet[MAX_PACKET_SIZE];
 	if (udp) {
 		writeInt32(packet, htonl(packet_seq++));
-		writeInt32(packet + 4, htonl(0));
+		writeInt32(packet + 4, htonl(ring_slots << REQ_WINDOW_SHIFT | REQ_CAP_CRC | REQ_CAP_FEC | datagram_size));
+		memset(ring_len, 0, sizeof(ring_len));
+		crc_seen = 0;
+		read_seq = INITIAL_SEQ;
+		read_off = 0;
+		ack_seq = INITIAL_SEQ;
 		memcpy(packet + 4 + PACKET_RESERVE_SIZE, src, length);
 		return sendto(sock_fd, packet, length + 4 + PACKET_RESERVE_SIZE, 0,	(struct sockaddr*) &server_addr, sizeof(server_addr));
 	} else {
@@ -103,23 +212,239 @@ int tsend(const char* src, long length) {
 	}
 }
 
+//one ACK for everything received so far: the cumulative seq, the SACK flag and a bitmap
+//of the packets after it in the receive window, 32 per word, cut after the last word in use
+void sendSack() {
+	char ack[8 + RECV_RING / 8];
+	unsigned int bitmap = 0;
+	int k, len = 12;
+	while (ack_seq - read_seq < ring_slots && ring_len[ack_seq % ring_slots]) {
+		++ack_seq;
+	}
+	writeInt32(ack + 8, 0);
+	for (k = 0; ack_seq + 1 + k - read_seq < ring_slots; ++k) {
+		if (ring_len[(ack_seq + 1 + k) % ring_slots]) {bitmap |= 1u << (k & 31);} 
+		if ((k & 31) == 31) {
+			writeInt32(ack + 8 + 4 * (k >> 5), htonl(bitmap));
+			if (bitmap) {len = 12 + 4 * (k >> 5);} 
+			bitmap = 0;
+		}
+	}
+	if (k & 31) {
+		writeInt32(ack + 8 + 4 * (k >> 5), htonl(bitmap));
+		if (bitmap) {len = 12 + 4 * (k >> 5);} 
+	}
+	writeInt32(ack, htonl(ack_seq));
+	writeInt32(ack + 4, htonl(ACK_FLAG_SACK));
+	sendto(sock_fd, ack, len, 0, (struct sockaddr*) &server_addr, sizeof(server_addr));
+}
+
+//ask for an immediate resend of a packet that failed its CRC32C, unless its seq is
+//implausible (the header may be what was corrupted) or the packet is already here
+void sendNak(int seq) {
+	char nak[8];
+	if (seq < ack_seq || seq - read_seq >= ring_slots || ring_len[seq % ring_slots]) {return;}
+	writeInt32(nak, htonl(seq));
+	writeInt32(nak + 4, htonl(ACK_FLAG_NAK));
+	sendto(sock_fd, nak, sizeof(nak), 0, (struct sockaddr*) &server_addr, sizeof(server_addr));
+}
+
+uint32_t crc32cSoft(uint32_t crc, const char* buf, size_t len) {
+	for (; len > 0; --len) {
+		crc = crc32c_table[(crc ^ (unsigned char) *buf++) & 0xff] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+#if defined(__x86_64__)
+//the SSE4.2 crc32 instruction, 8 bytes at a time
+__attribute__((target("sse4.2"))) uint32_t crc32cHard(uint32_t crc, const char* buf, size_t len) {
+	uint64_t c = crc, v;
+	for (; len >= 8; len -= 8, buf += 8) {
+		memcpy(&v, buf, 8);
+		c = _mm_crc32_u64(c, v);
+	}
+	for (; len > 0; --len) {
+		c = _mm_crc32_u8((uint32_t) c, *buf++);
+	}
+	return (uint32_t) c;
+}
+#else
+uint32_t crc32cHard(uint32_t crc, const char* buf, size_t len) {
+	return crc32cSoft(crc, buf, len);
+}
+#endif
+
+//build the table of the portable CRC32C and use the crc32 instruction when the CPU has it
+void crc32cInit() {
+	uint32_t c;
+	int k, b;
+	for (k = 0; k < 256; ++k) {
+		for (c = k, b = 0; b < 8; ++b) {
+			c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+		}
+		crc32c_table[k] = c;
+	}
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2")) {crc32cUpdate = crc32cHard;}
+#endif
+}
+
+// dst ^= src, a 64-bit word at a time
+void xorBytes(char* dst, const char* src, int n) {
+	uint64_t a, b;
+	int k;
+	for (k = 0; k + 8 <= n; k += 8) {
+		memcpy(&a, dst + k, 8);
+		memcpy(&b, src + k, 8);
+		a ^= b;
+		memcpy(dst + k, &a, 8);
+	}
+	for (; k < n; ++k) {
+		dst[k] ^= src[k];
+	}
+}
+
+//a parity packet covers count packets from the seq in its header; when exactly one of them
+//is missing it is the XOR of the parity payload and the others, its length the XOR of
+//the lengths in the parity's reserved field and theirs; return 1 if a packet was rebuilt
+int fecRecover(const char* parity, int length) {
+	unsigned int flags = ntohl(readInt32(parity + 4));
+	int first = ntohl(readInt32(parity)), count = (flags >> 16) & 0xff, len = flags & 0xffff;
+	int k, seq, missing = -1;
+	char* packet;
+	if (first < read_seq || first + count - read_seq > ring_slots) {return 0;} 
+	for (seq = first; seq < first + count; ++seq) {
+		if (ring_len[seq % ring_slots]) {continue;} 
+		if (missing >= 0) {return 0;} 
+		missing = seq;
+	}
+	if (missing < 0) {return 0;} 
+	packet = ring[missing % ring_slots];
+	memcpy(packet + 4 + PACKET_RESERVE_SIZE, parity + 4 + PACKET_RESERVE_SIZE, length - 4 - PACKET_RESERVE_SIZE);
+	for (seq = first; seq < first + count; ++seq) {
+		if (seq == missing) {continue;} 
+		k = ring_len[seq % ring_slots] - 4 - PACKET_RESERVE_SIZE;
+		if (k > length - 4 - PACKET_RESERVE_SIZE) {return 0;} 
+		xorBytes(packet + 4 + PACKET_RESERVE_SIZE, ring[seq % ring_slots] + 4 + PACKET_RESERVE_SIZE, k);
+		len ^= k;
+	}
+	if (len < 1 || len > length - 4 - PACKET_RESERVE_SIZE) {return 0;} 
+	writeInt32(packet, htonl(missing));
+	writeInt32(packet + 4, htonl(0));
+	ring_len[missing % ring_slots] = 4 + PACKET_RESERVE_SIZE + len;
+	return 1;
+}
+
+//MTU of the route to addr, read from a connected UDP socket that never sends; 0 if unknown
+int pathMtu(const struct sockaddr_in* addr) {
+	int fd, mtu = 0, pmtu = IP_PMTUDISC_DO;
+	socklen_t len = sizeof(mtu);
+	if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+		return 0;
+	}
+	setsockopt(fd, IPPROTO_IP, IP_MTU_DISCOVER, &pmtu, sizeof(pmtu));
+	if (connect(fd, (const struct sockaddr*) addr, sizeof(*addr)) == -1
+		|| getsockopt(fd, IPPROTO_IP, IP_MTU, &mtu, &len) == -1) {
+		mtu = 0;
+	}
+	close(fd);
+	return mtu;
+}
+
+//wait for at least one UDP packet and take every packet already queued with it into
+//the receive window, then acknowledge them all with one SACK; duplicates are dropped,
+//and so are packets too far ahead for the window (the server resends them) and packets
+//failing their CRC32C, which are NAKed
+int recvBatch() {
+	struct mmsghdr msgs[RECV_BATCH];
+	struct iovec iovs[RECV_BATCH];
+	struct sockaddr_in peers[RECV_BATCH];
+	char* tmp;
+	unsigned int flags;
+	int k, n, seq, acks = 0;
+	memset(msgs, 0, sizeof(msgs));
+	for (k = 0; k < RECV_BATCH; ++k) {
+		iovs[k].iov_base = stage[k];
+		iovs[k].iov_len = datagram_size;
+		msgs[k].msg_hdr.msg_iov = &iovs[k];
+		msgs[k].msg_hdr.msg_iovlen = 1;
+		msgs[k].msg_hdr.msg_name = &peers[k];
+		msgs[k].msg_hdr.msg_namelen = sizeof(peers[k]);
+	}
+	if ((n = recvmmsg(sock_fd, msgs, RECV_BATCH, MSG_WAITFORONE, NULL)) < 1) {
+		return -1;
+	}
+	for (k = 0; k < n; ++k) {
+		if (msgs[k].msg_hdr.msg_namelen != sizeof(server_addr)
+			|| memcmp((const void*) &peers[k], (const void*) &server_addr, sizeof(server_addr)) != 0) {
+			continue;
+		}
+		if (msgs[k].msg_len < 4 + PACKET_RESERVE_SIZE) {
+			continue;
+		}
+		flags = ntohl(readInt32(stage[k] + 4)) >> 24;
+		if (flags & PACKET_FLAG_CRC || crc_seen) {
+			if (!(flags & PACKET_FLAG_CRC) || msgs[k].msg_len < 4 + PACKET_RESERVE_SIZE + CRC_SIZE
+				|| ~crc32cUpdate(~0u, stage[k], msgs[k].msg_len - CRC_SIZE) != ntohl(readInt32(stage[k] + msgs[k].msg_len - CRC_SIZE))) {
+				++crc_failures;
+				if (!(flags & PACKET_FLAG_PARITY)) {sendNak(ntohl(readInt32(stage[k])));}
+				continue;
+			}
+			crc_seen = 1;
+			msgs[k].msg_len -= CRC_SIZE;
+		}
+		if (flags & PACKET_FLAG_PARITY) {
+			acks += fecRecover(stage[k], msgs[k].msg_len);
+			continue;
+		}
+		++acks;
+		seq = ntohl(readInt32(stage[k]));
+		if (seq < ack_seq || seq - read_seq >= ring_slots || ring_len[seq % ring_slots]) {
+			continue;
+		}
+		tmp = ring[seq % ring_slots];
+		ring[seq % ring_slots] = stage[k];
+		stage[k] = tmp;
+		ring_len[seq % ring_slots] = msgs[k].msg_len;
+	}
+	if (acks > 0) {
+		sendSack();
+	}
+	return 0;
+}
+
+//mark n payload bytes of the in-order packets as read, freeing the slots of whole packets
+void ringConsume(int n) {
+	int k;
+	while (n > 0) {
+		k = ring_len[read_seq % ring_slots] - 4 - PACKET_RESERVE_SIZE - read_off;
+		if (n < k) {
+			read_off += n;
+			return;
+		}
+		n -= k;
+		ring_len[read_seq++ % ring_slots] = 0;
+		read_off = 0;
+	}
+}
+
 int trecv(char* dst, long max_length) {
-	char packet[MAX_PACKET_SIZE];
-	struct sockaddr_in peer;
-	socklen_t addrlen = sizeof peer;
 	int ret;
 	if (udp) {
-		ret = recvfrom(sock_fd, packet, MAX_PACKET_SIZE, 0, (struct sockaddr*) &peer, &addrlen);
-		if (addrlen != sizeof(peer) || memcmp((const void*) &peer, (const void*) &server_addr, addrlen) != 0) {
-			return -1;
-		}		
-		if (ret < 4 + PACKET_RESERVE_SIZE) {
-			return -1;
-		} 
-		//ACK
-		sendto(sock_fd, packet, 4 + PACKET_RESERVE_SIZE, 0, (struct sockaddr*) &server_addr, sizeof(server_addr));
-		ret -= 4 + PACKET_RESERVE_SIZE;
-		memcpy(dst, packet + 4 + PACKET_RESERVE_SIZE, ret);
+		//skip empty packets, wait for the next one in order
+		while (read_seq == ack_seq || ring_len[read_seq % ring_slots] == 4 + PACKET_RESERVE_SIZE) {
+			if (read_seq < ack_seq) {
+				ring_len[read_seq++ % ring_slots] = 0;
+			} else if (recvBatch()) {
+				return -1;
+			}
+		}
+		//the rest of the packet is kept for the next read
+		ret = ring_len[read_seq % ring_slots] - 4 - PACKET_RESERVE_SIZE - read_off;
+		if (ret > max_length) {ret = max_length;} 
+		memcpy(dst, ring[read_seq % ring_slots] + 4 + PACKET_RESERVE_SIZE + read_off, ret);
+		ringConsume(ret);
 		return ret;
 	} else {
 		return recv(sock_fd, dst, max_length, 0);
@@ -155,7 +480,10 @@ int readMsg(char* buf){
 
 void UDPconnect(){
 	struct hostent* host; 
+	int k, rcvbuf = UDP_RCVBUF;
 	sock_fd = socket(AF_INET, SOCK_DGRAM, 0);
+	//room for a whole congestion window of packets
+	setsockopt(sock_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
 	bzero(&server_addr, sizeof(struct sockaddr_in));
 	if ((host = gethostbyname(hostname)) == NULL) {   
 		fprintf(stderr, "fail to get host ip !\n");
@@ -164,6 +492,24 @@ void UDPconnect(){
 	server_addr.sin_family = AF_INET;
 	server_addr.sin_addr.s_addr = *(in_addr_t*) *host->h_addr_list;
 	server_addr.sin_port = htons(port);
+	if (recv_buf) {return;} 
+	//unless -s says otherwise, ask for the largest datagram the route carries unfragmented
+	if (datagram_size == 0 && (datagram_size = pathMtu(&server_addr) - IP_UDP_HEADERS) < DATAGRAM_MIN) {
+		datagram_size = MAX_PACKET_SIZE;
+	}
+	if (datagram_size > DATAGRAM_MAX) {datagram_size = DATAGRAM_MAX;} 
+	datagram_size &= REQ_SIZE_MASK;
+	if ((ring_slots = UDP_RCVBUF / datagram_size) > RECV_RING) {ring_slots = RECV_RING;} 
+	if (NULL == (recv_buf = (char*) malloc((long) (ring_slots + RECV_BATCH) * datagram_size))) {
+		fprintf(stderr, "fail to allocate memory: %s(errno: %d)\n", strerror(errno), errno);
+		exit(1);
+	}
+	for (k = 0; k < ring_slots; ++k) {
+		ring[k] = recv_buf + (long) k * datagram_size;
+	}
+	for (k = 0; k < RECV_BATCH; ++k) {
+		stage[k] = recv_buf + (long) (ring_slots + k) * datagram_size;
+	}
 }
 
 void TCPconnect(){
@@ -191,11 +537,7 @@ void setConnectMode() {
 	}
 }
 
-int filetype(int argc, char* argv[]) {
-	int ret;
-	int len;
-	int k;
-	char buff[MAX_PACKET_SIZE] = {0};  
+int filetype(int argc, char* argv[], struct Op* op) {
 	if(argc > 2) {
 		fprintf(stderr, "error: too much parameters\n");
 		return 1;
@@ -208,38 +550,17 @@ int filetype(int argc, char* argv[]) {
 		udp = 1;
 		++argv;
 	}
-	strcpy(filename, argv[0]);
-	setConnectMode();
-	buff[0] = (char) FILETYPE_REQ;
-	writeInt32(buff + 1, htonl(strlen(filename)));
-	strcpy(buff + 5, filename);
-	ret = tsend(buff, 5 + strlen(filename));
-	if (readMsg(buff)) {
-		fprintf(stderr, "fail to get response from server!\n");
-	} else {
-		if ((0xff & buff[0]) == FILETYPE_RSP) {
-			len = ntohl(readInt32(buff + 1));
-			buff[5 + len] = '\0';
-			for (k = 0; k < len; k++) {			
-				if((0xff & buff[5 + k]) > 0x7f) {break;}
-			}
-			if (k < len) {
-				fprintf(stdout, "Invalid characters detected in a FILETYPE_RSP message.\n");
-			} else {
-				fprintf(stdout, "%s\n", &buff[5]);
-			}
-		} else if ((0xff & buff[0]) == FILETYPE_ERR) {
-			fprintf(stdout, "FILETYPE_ERR received from the server\n");
-		}
+	if (argc < 1) {
+		fprintf(stderr, "error: need filename\n");
+		return 1;
 	}
-	close(sock_fd);
+	strcpy(op->filename, argv[0]);
 	return 0;
 }
 
-int checksum(int argc, char*argv[]) {
-	char buff[MAX_PACKET_SIZE] = {0};  
-	int k, ret, len;
-	if(argc > 6) {
+int checksum(int argc, char*argv[], struct Op* op) {
+	int k;
+	if(argc > 8) {
 		fprintf(stderr, "error: too much parameters\n");
 		return 1;
 	}
@@ -251,7 +572,7 @@ int checksum(int argc, char*argv[]) {
 				fprintf(stderr, "error: need offset\n");
 				return 1;
 			}
-			if ((offset = atoi(argv[++k])) < 0) {
+			if ((op->offset = atoi(argv[++k])) < 0) {
 				fprintf(stderr, "error: illegal offset!\n");
 				return 1;
 			}
@@ -260,59 +581,99 @@ int checksum(int argc, char*argv[]) {
 				fprintf(stderr, "error: need length\n");
 				return 1;
 			}
-			if (!(length = atoi(argv[++k]))) {
+			if (!(op->length = atoi(argv[++k]))) {
 				fprintf(stderr, "error: illegal length!\n");
 				return 1;
 			}
+		} else if (strcmp("-a", argv[k]) == 0) {
+			if (argc == k + 1) {
+				fprintf(stderr, "error: need hash algorithm\n");
+				return 1;
+			}
+			++k;
+			for (op->algo = 1; op->algo < sizeof(hash_names) / sizeof(hash_names[0]) && strcmp(hash_names[op->algo], argv[k]); ++op->algo);
+			if (op->algo == sizeof(hash_names) / sizeof(hash_names[0])) {
+				fprintf(stderr, "error: illegal hash algorithm! (md5, sha1, sha256, sha512-256, blake2s or blake2b)\n");
+				return 1;
+			}
 		} else {
-			strcpy(filename, argv[k]);
+			strcpy(op->filename, argv[k]);
 		}
 	}
-	setConnectMode();
-	buff[0] = (char)CHECKSUM_REQ;
-	writeInt32(buff + 1, htonl(8 + strlen(filename)));
-	writeInt32(buff + 5, htonl(offset));
-	writeInt32(buff + 9, htonl(length));
-	strcpy(buff + 13, filename);
-	ret = tsend(buff, 13 + strlen(filename));
-	if(readMsg(buff)) {
-		fprintf(stderr, "fail to get response from server!\n");
-	} else {
-		if ((0xff & buff[0]) == CHECKSUM_RSP) {
-			len = ntohl(readInt32(buff + 1));
-			if (len != 16) {
-				fprintf(stdout,"Invalid DataLength detected in a CHECKSUM_RSP message.\n");
-			} else {
-				for (k = 0; k < 16; k++) {
-					fprintf(stdout, "%02x", (0xff & buff[5 + k]));
-				}
-				fprintf(stdout, "\n");
+	return 0;
+}
+
+int treesum(int argc, char* argv[], struct Op* op) {
+	int k;
+	if (argc > 10) {
+		fprintf(stderr, "error: too much parameters\n");
+		return 1;
+	}
+	for (k = 0; k < argc; ++k) {
+		if (strcmp("-udp", argv[k]) == 0) {
+			udp = 1;
+		} else if (strcmp("-o", argv[k]) == 0) {
+			if (k + 1 == argc) {
+				fprintf(stderr, "error: need offset\n");
+				return 1;
 			}
-		} else if ((0xff & buff[0]) == CHECKSUM_ERR) {
-			fprintf(stdout, "CHECKSUM_ERR received from the server\n");
+			if ((op->offset = atoi(argv[++k])) < 0) {
+				fprintf(stderr, "error: illegal offset!\n");
+				return 1;
+			}
+		} else if (strcmp("-l", argv[k]) == 0) {
+			if (argc == k + 1) {
+				fprintf(stderr, "error: need length\n");
+				return 1;
+			}
+			if (!(op->length = atoi(argv[++k]))) {
+				fprintf(stderr, "error: illegal length!\n");
+				return 1;
+			}
+		} else if (strcmp("-k", argv[k]) == 0) {
+			if (argc == k + 1) {
+				fprintf(stderr, "error: need chunk size\n");
+				return 1;
+			}
+			if ((op->chunk = atoi(argv[++k])) <= 0 || (op->chunk & (op->chunk - 1))) {
+				fprintf(stderr, "error: illegal chunk size!\n");
+				return 1;
+			}
+		} else if (strcmp("-v", argv[k]) == 0) {
+			op->leaves = 1;
+		} else if (!op->filename[0]) {
+			strcpy(op->filename, argv[k]);
+		} else {
+			strcpy(op->localfile, argv[k]);
 		}
 	}
-	close(sock_fd);
 	return 0;
 }
 
-int download(int argc, char* argv[]) {
-	char buff[MAX_PACKET_SIZE] = {0};
-	int k, ret, len;
-	FILE* pf;
-	if (argc > 7) {
+int download(int argc, char* argv[], struct Op* op) {
+	int k;
+	if (argc > 14) {
 		fprintf(stderr, "error: too much parameters\n");
 		return 1;
 	}
 	for (k = 0; k < argc; ++k) {
 		if (strcmp("-udp", argv[k]) == 0) {
 			udp = 1;
+		} else if (strcmp("-s", argv[k]) == 0) {
+			if (argc == k + 1) {
+				fprintf(stderr, "error: need datagram size\n");
+				return 1;
+			}
+			if ((datagram_size = atoi(argv[++k])) < DATAGRAM_MIN || datagram_size > DATAGRAM_MAX) {
+				fprintf(stderr, "error: illegal datagram size!\n");
+				return 1;
+			}
 		} else if (strcmp("-o", argv[k]) == 0) {
 			if (argc == k + 1) {
 				fprintf(stderr, "error: need offset\n");
 				return 1;
 			}
-			if (!(offset = atoi(argv[++k]))) {
+			if (!(op->offset = atoi(argv[++k]))) {
 				fprintf(stderr, "error: illegal offset!\n");
 				return 1;
 			}
@@ -321,51 +682,641 @@ int download(int argc, char* argv[]) {
 				fprintf(stderr, "error: need length\n");
 				return 1;
 			}
-			if (!(length = atoi(argv[++k]))) {
+			if (!(op->length = atoi(argv[++k]))) {
 				fprintf(stderr, "error: illegal length!\n");
 				return 1;
 			}
-		} else if (!filename[0]) {
-			strcpy(filename, argv[k]);
+		} else if (strcmp("-z", argv[k]) == 0) {
+			op->compress = 1;
+		} else if (strcmp("-V", argv[k]) == 0) {
+			op->digest = 1;
+		} else if (strcmp("-c", argv[k]) == 0) {
+			op->resume = 1;
+		} else if (strcmp("-P", argv[k]) == 0) {
+			if (argc == k + 1) {
+				fprintf(stderr, "error: need number of connections\n");
+				return 1;
+			}
+			if ((op->parallel = atoi(argv[++k])) < 1 || op->parallel > MAX_PARALLEL) {
+				fprintf(stderr, "error: illegal number of connections!\n");
+				return 1;
+			}
+		} else if (!op->filename[0]) {
+			strcpy(op->filename, argv[k]);
 		} else {
-			strcpy(saveasfilename, argv[k]);
+			strcpy(op->saveasfilename, argv[k]);
 		}
 	}
-	setConnectMode();
-	buff[0] = (char) DOWNLOAD_REQ;
-	writeInt32(buff + 1, htonl(8 + strlen(filename)));
-	writeInt32(buff + 5, htonl(offset));
-	writeInt32(buff + 9, htonl(length)); 
-	strcpy(buff + 13, filename);
-	ret = tsend(buff, 13 + strlen(filename));
+	if (op->resume && op->parallel > 1) {
+		fprintf(stderr, "error: -c and -P cannot be used together\n");
+		return 1;
+	}
+	return 0;
+}
+
+int parseOp(const char* command, int argc, char* argv[], struct Op* op) {
+	memset(op, 0, sizeof(struct Op));
+	op->length = -1;
+	op->parallel = 1;
+	if (strcmp("filetype", command) == 0) {
+		op->type = FILETYPE_REQ;
+		return filetype(argc, argv, op);
+	} else if (strcmp("checksum", command) == 0) {
+		op->type = CHECKSUM_REQ;
+		return checksum(argc, argv, op);
+	} else if (strcmp("treesum", command) == 0) {
+		op->type = CHECKSUM_TREE_REQ;
+		return treesum(argc, argv, op);
+	} else if (strcmp("download", command) == 0) {
+		op->type = DOWNLOAD_REQ;
+		return download(argc, argv, op);
+	}
+	fprintf(stderr, "error: illegal command!");
+	return 1;
+}
+
+int sendOp(const struct Op* op) {
+	char buff[MAX_PACKET_SIZE] = {0};
+	int len = strlen(op->filename);
+	buff[0] = (char) op->type;
+	if (op->type == FILETYPE_REQ || op->type == FILESIZE_REQ) {
+		writeInt32(buff + 1, htonl(len));
+		strcpy(buff + 5, op->filename);
+		return tsend(buff, 5 + len);
+	}
+	if (op->type == DOWNLOAD_REQ && op->compress) {
+		buff[0] = (char) DOWNLOAD_ZREQ;
+		writeInt32(buff + 1, htonl(9 + len));
+		writeInt32(buff + 5, htonl(op->offset));
+		writeInt32(buff + 9, htonl(op->length));
+		buff[13] = ZCODEC_DEFLATE;
+		strcpy(buff + 14, op->filename);
+		return tsend(buff, 14 + len);
+	}
+	if (op->type == CHECKSUM_REQ && op->algo) {
+		buff[0] = (char) CHECKSUM_AREQ;
+		writeInt32(buff + 1, htonl(9 + len));
+		writeInt32(buff + 5, htonl(op->offset));
+		writeInt32(buff + 9, htonl(op->length));
+		buff[13] = (char) op->algo;
+		strcpy(buff + 14, op->filename);
+		return tsend(buff, 14 + len);
+	}
+	if (op->type == CHECKSUM_TREE_REQ) {
+		writeInt32(buff + 1, htonl(13 + len));
+		writeInt32(buff + 5, htonl(op->offset));
+		writeInt32(buff + 9, htonl(op->length));
+		writeInt32(buff + 13, htonl(op->chunk));
+		buff[17] = op->leaves || op->localfile[0] ? TREE_FLAG_LEAVES : 0;
+		strcpy(buff + 18, op->filename);
+		return tsend(buff, 18 + len);
+	}
+	writeInt32(buff + 1, htonl(8 + len));
+	writeInt32(buff + 5, htonl(op->offset));
+	writeInt32(buff + 9, htonl(op->length));
+	strcpy(buff + 13, op->filename);
+	return tsend(buff, 13 + len);
+}
+
+void recvFiletype(const struct Op* op) {
+	int len;
+	int k;
+	char buff[MAX_PACKET_SIZE] = {0};  
+	if (readMsg(buff)) {
+		fprintf(stderr, "fail to get response from server!\n");
+	} else {
+		if ((0xff & buff[0]) == FILETYPE_RSP) {
+			len = ntohl(readInt32(buff + 1));
+			buff[5 + len] = '\0';
+			for (k = 0; k < len; k++) {			
+				if((0xff & buff[5 + k]) > 0x7f) {break;}
+			}
+			if (k < len) {
+				fprintf(stdout, "Invalid characters detected in a FILETYPE_RSP message.\n");
+			} else {
+				fprintf(stdout, "%s\n", &buff[5]);
+			}
+		} else if ((0xff & buff[0]) == FILETYPE_ERR) {
+			fprintf(stdout, "FILETYPE_ERR received from the server\n");
+		}
+	}
+}
+
+void recvChecksum(const struct Op* op) {
+	char buff[MAX_PACKET_SIZE] = {0};  
+	int k, len;
+	if(readMsg(buff)) {
+		fprintf(stderr, "fail to get response from server!\n");
+	} else {
+		if ((0xff & buff[0]) == CHECKSUM_RSP) {
+			len = ntohl(readInt32(buff + 1));
+			if (len < 16 || len > 64) {
+				fprintf(stdout,"Invalid DataLength detected in a CHECKSUM_RSP message.\n");
+			} else {
+				for (k = 0; k < len; k++) {
+					fprintf(stdout, "%02x", (0xff & buff[5 + k]));
+				}
+				fprintf(stdout, "\n");
+			}
+		} else if ((0xff & buff[0]) == CHECKSUM_ERR) {
+			fprintf(stdout, "CHECKSUM_ERR received from the server\n");
+		}
+	}
+}
+
+//fold n digests pairwise into their root as the server does, MD5(left || right) a level at a time
+void treeRoot(unsigned char* nodes, int n, unsigned char root[]) {
+	int k;
+	for (; n > 1; n = (n + 1) / 2) {
+		for (k = 0; k + 1 < n; k += 2) {
+			EVP_Digest(nodes + 16 * k, 32, nodes + 16 * (k / 2), NULL, EVP_md5(), NULL);
+		}
+		if (n & 1) {memmove(nodes + 16 * (n / 2), nodes + 16 * (n - 1), 16);}
+	}
+	memcpy(root, nodes, 16);
+}
+
+//print the root, then the chunk digests with -v, or the chunks that differ from localfile
+void recvTreeChecksum(const struct Op* op) {
+	char buff[MAX_PACKET_SIZE] = {0};
+	unsigned char local[16];
+	unsigned char* leaves = NULL;
+	struct stat st;
+	int k, j, fd, len, chunk, count, total, n, diffs = 0;
+	if (readData(buff, 5)) {
+		fprintf(stderr, "fail to get response from server!\n");
+		return;
+	}
+	if ((0xff & buff[0]) == CHECKSUM_TREE_ERR) {
+		fprintf(stdout, "CHECKSUM_TREE_ERR received from the server\n");
+		return;
+	}
+	len = ntohl(readInt32(buff + 1));
+	if ((0xff & buff[0]) != CHECKSUM_TREE_RSP || len < 24 || readData(buff + 5, 24)) {
+		fprintf(stdout, "Invalid CHECKSUM_TREE_RSP message.\n");
+		return;
+	}
+	chunk = ntohl(readInt32(buff + 5));
+	count = ntohl(readInt32(buff + 9));
+	if (len > 24 && (len != 24 + 16 * count || NULL == (leaves = (unsigned char* ) malloc(len - 24)))) {
+		fprintf(stdout, "Invalid DataLength detected in a CHECKSUM_TREE_RSP message.\n");
+		//still consume the leaf digests, so the next response on this connection is read from its head
+		if ((fd = open("/dev/null", O_WRONLY)) != -1) {
+			recvBody(fd, 0, len - 24);
+			close(fd);
+		}
+		return;
+	}
+	if (leaves && readData((char* ) leaves, len - 24)) {
+		fprintf(stderr, "fail to get response from server!\n");
+		free(leaves);
+		return;
+	}
+	for (k = 0; k < 16; k++) {
+		fprintf(stdout, "%02x", (0xff & buff[13 + k]));
+	}
+	fprintf(stdout, "  (%d chunks of %d bytes)\n", count, chunk);
+	for (k = 0; leaves && op->leaves && k < count; ++k) {
+		fprintf(stdout, "%8d %12ld ", k, op->offset + (long) k * chunk);
+		for (j = 0; j < 16; j++) {
+			fprintf(stdout, "%02x", leaves[16 * k + j]);
+		}
+		fprintf(stdout, "\n");
+	}
+	if (leaves && op->localfile[0]) {
+		if (stat(op->localfile, &st) == -1) {
+			fprintf(stderr, "fail to open %s!\n", op->localfile);
+		} else {
+			total = op->length > 0 ? op->length : st.st_size - op->offset;
+			for (k = 0; k < count || (long) k * chunk < total; ++k) {
+				n = total - k * chunk > chunk ? chunk : total - k * chunk;
+				if (k < count && n > 0 && !localChecksum(op->localfile, op->offset + k * chunk, n, local)
+					&& memcmp(local, leaves + 16 * k, 16) == 0) {
+					continue;
+				}
+				fprintf(stdout, "...chunk %d (bytes %ld to %ld) differs from '%s'\n",
+					k, op->offset + (long) k * chunk, op->offset + (long) (k + 1) * chunk - 1, op->localfile);
+				++diffs;
+			}
+			if (diffs == 0) {
+				fprintf(stdout, "...'%s' matches the server\n", op->localfile);
+			}
+		}
+	}
+	free(leaves);
+}
+
+//write the next len bytes of the response body at pos
+int recvBody(int fd, off_t pos, int len) {
+	char buff[MAX_PACKET_SIZE];
+	int k;
+	if (udp) {
+		return recvRingBody(fd, pos, len);
+	}
+	while (len > 0) {
+		k = len > sizeof(buff) ? sizeof(buff) : len;
+		if ((k = trecv(buff, k)) < 1) {
+			fprintf(stderr, "fail to receive data from server!\n");
+			return 1;
+		}
+		if (pwrite(fd, buff, k, pos) != k) {
+			fprintf(stderr, "fail to write save file!\n");
+			return 1;
+		}
+		pos += k;
+		len -= k;
+	}
+	return 0;
+}
+
+//write every run of in-order UDP packets straight from the receive window with one pwritev()
+int recvRingBody(int fd, off_t pos, int len) {
+	struct iovec iov[IOV_MAX];
+	int n, k, seq, total;
+	while (len > 0) {
+		while (read_seq == ack_seq) {
+			if (recvBatch()) {
+				fprintf(stderr, "fail to receive data from server!\n");
+				return 1;
+			}
+		}
+		n = 0;
+		total = 0;
+		for (seq = read_seq; seq < ack_seq && n < IOV_MAX && total < len; ++seq) {
+			k = ring_len[seq % ring_slots] - 4 - PACKET_RESERVE_SIZE - (seq == read_seq ? read_off : 0);
+			if (k > len - total) {k = len - total;} 
+			iov[n].iov_base = ring[seq % ring_slots] + 4 + PACKET_RESERVE_SIZE + (seq == read_seq ? read_off : 0);
+			iov[n++].iov_len = k;
+			total += k;
+		}
+		if (pwritev(fd, iov, n, pos) != total) {
+			fprintf(stderr, "fail to write save file!\n");
+			return 1;
+		}
+		for (k = 0; body_hashing && k < n; ++k) {
+			if (!EVP_DigestUpdate(body_md5, iov[k].iov_base, iov[k].iov_len)) {body_hashing = 0;}
+		}
+		ringConsume(total);
+		pos += total;
+		len -= total;
+	}
+	return 0;
+}
+
+//inflate len bytes of DOWNLOAD_ZRSP frames (compressed length, raw length, data) to pos
+int recvZBody(int fd, off_t pos, int len) {
+	char head[8];
+	char* in = (char*) malloc(ZFRAME_MAX);
+	char* out = (char*) malloc(ZFRAME_RAW_MAX);
+	z_stream zs;
+	int clen, ulen, ret = 1;
+	memset(&zs, 0, sizeof(zs));
+	if (NULL == in || NULL == out || inflateInit(&zs) != Z_OK) {
+		fprintf(stderr, "fail to start decompression!\n");
+		free(in);
+		free(out);
+		return 1;
+	}
+	while (len > 0) {
+		if (readData(head, 8)) {
+			fprintf(stderr, "fail to receive data from server!\n");
+			break;
+		}
+		clen = ntohl(readInt32(head));
+		ulen = ntohl(readInt32(head + 4));
+		if (clen < 0 || clen > ZFRAME_MAX || ulen < 1 || ulen > ZFRAME_RAW_MAX || ulen > len) {
+			fprintf(stderr, "Invalid frame detected in a DOWNLOAD_ZRSP message.\n");
+			break;
+		}
+		if (readData(in, clen)) {
+			fprintf(stderr, "fail to receive data from server!\n");
+			break;
+		}
+		zs.next_in = (Bytef*) in;
+		zs.avail_in = clen;
+		zs.next_out = (Bytef*) out;
+		zs.avail_out = ulen;
+		if (inflate(&zs, Z_SYNC_FLUSH) < 0 || zs.avail_out != 0) {
+			fprintf(stderr, "fail to decompress data from server!\n");
+			break;
+		}
+		if (pwrite(fd, out, ulen, pos) != ulen) {
+			fprintf(stderr, "fail to write save file!\n");
+			break;
+		}
+		pos += ulen;
+		len -= ulen;
+	}
+	if (len == 0) {ret = 0;}
+	inflateEnd(&zs);
+	free(in);
+	free(out);
+	return ret;
+}
+
+int recvAnyBody(int type, int fd, off_t pos, int len) {
+	return type == DOWNLOAD_ZRSP ? recvZBody(fd, pos, len) : recvBody(fd, pos, len);
+}
+
+void recvDownload(const struct Op* op) {
+	char buff[MAX_PACKET_SIZE] = {0};
+	unsigned char md5_sum[16];
+	int fd, len, k;
 	//get head of reponse
 	if (readData(buff, 5)) {
 		//fail to get the head
 		fprintf(stderr, "fail to get response from server!\n");
 	} else {
-		if((0xff & buff[0]) == DOWNLOAD_RSP) {//successful reponse
-			len = ntohl(readInt32(buff + 1));//data length
-			if (NULL == (pf = fopen(saveasfilename, "wb"))) {
-				fprintf(stderr, "fail to open save file %s!\n", saveasfilename);
+		if((0xff & buff[0]) == DOWNLOAD_RSP || (0xff & buff[0]) == DOWNLOAD_ZRSP) {//successful reponse
+			len = ntohl(readInt32(buff + 1));//data length, uncompressed
+			if ((fd = open(op->saveasfilename, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+				fprintf(stderr, "fail to open save file %s!\n", op->saveasfilename);
+				//still consume the body, so the next response on this connection is read from its head
+				if ((fd = open("/dev/null", O_WRONLY)) != -1) {
+					recvAnyBody(0xff & buff[0], fd, 0, len);
+					close(fd);
+				}
 			} else {
-				//download file
-				while (len > 0) {
-					k = len > sizeof(buff) ? sizeof(buff) : len;
-					if ((k = trecv(buff, sizeof(buff))) < 1) {
-						fprintf(stderr, "fail to receive data from server!\n");
-						break;
-					} else {
-						fwrite(buff, 1, k, pf);
+				//download file, never reading past this response; a UDP body is hashed as it is written
+				if ((body_hashing = op->digest && udp && (0xff & buff[0]) == DOWNLOAD_RSP)) {
+					if (NULL == body_md5) {body_md5 = EVP_MD_CTX_new();}
+					body_hashing = body_md5 && EVP_DigestInit_ex(body_md5, EVP_md5(), NULL);
+				}
+				k = recvAnyBody(0xff & buff[0], fd, 0, len);
+				close(fd);
+				fprintf(stdout, "...Downloaded data have been successfully written into '%s'\n", op->saveasfilename);
+				if (body_hashing && !k && EVP_DigestFinal_ex(body_md5, md5_sum, NULL)) {
+					fprintf(stdout, "...MD5 of the downloaded data: ");
+					for (k = 0; k < 16; k++) {
+						fprintf(stdout, "%02x", md5_sum[k]);
 					}
-					len -= k;
+					fprintf(stdout, "\n");
 				}
-				fclose(pf);
-				fprintf(stdout, "...Downloaded data have been successfully written into '%s'\n", saveasfilename);
+				if (crc_failures) {
+					fprintf(stdout, "...%ld packets failed their CRC32C and were asked again\n", crc_failures);
+				}
+				body_hashing = 0;
 			}
 		} else if ((0xff & buff[0]) == DOWNLOAD_ERR) {
 			fprintf(stdout, "DOWNLOAD_ERR received from the server\n");
 		}
 	}
+}
+
+//ask the server for the size of file, -1 on failure
+int fileSize(const char* file) {
+	char buff[MAX_PACKET_SIZE] = {0};
+	struct Op op;
+	int size = -1;
+	memset(&op, 0, sizeof(op));
+	op.type = FILESIZE_REQ;
+	strcpy(op.filename, file);
+	setConnectMode();
+	sendOp(&op);
+	if (readMsg(buff)) {
+		fprintf(stderr, "fail to get response from server!\n");
+	} else if ((0xff & buff[0]) == FILESIZE_RSP && ntohl(readInt32(buff + 1)) == 4) {
+		size = ntohl(readInt32(buff + 5));
+	} else if ((0xff & buff[0]) == FILESIZE_ERR) {
+		fprintf(stdout, "FILESIZE_ERR received from the server\n");
+	}
+	close(sock_fd);
+	return size;
+}
+
+//split the range into op->parallel pieces, each fetched by its own process over its own
+//connection (or UDP session) and written in place into the preallocated save file
+int parallelDownload(const struct Op* op) {
+	char buff[MAX_PACKET_SIZE];
+	struct Op part;
+	int n = op->parallel;
+	int size, total, fd, k, status, failed = 0;
+	long lo, hi;
+	pid_t pid;
+	if ((size = fileSize(op->filename)) < 0) {
+		return 1;
+	}
+	total = op->length > 0 ? op->length : size - op->offset;
+	if (op->offset >= size || total <= 0 || op->offset + total > size) {
+		fprintf(stdout, "DOWNLOAD_ERR: illegal range for a file of %d bytes\n", size);
+		return 1;
+	}
+	if (n > total) {n = total;}
+	if ((fd = open(op->saveasfilename, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1 || ftruncate(fd, total) == -1) {
+		fprintf(stderr, "fail to open save file %s!\n", op->saveasfilename);
+		return 1;
+	}
+	for (k = 0; k < n; ++k) {
+		lo = (long) total * k / n;
+		hi = (long) total * (k + 1) / n;
+		if ((pid = fork()) == -1) {
+			fprintf(stderr, "fail to fork: %s\n", strerror(errno));
+			failed = 1;
+			break;
+		}
+		if (pid == 0) {
+			part = *op;
+			part.offset = op->offset + lo;
+			part.length = hi - lo;
+			setConnectMode();
+			sendOp(&part);
+			if (readData(buff, 5) || ((0xff & buff[0]) != DOWNLOAD_RSP && (0xff & buff[0]) != DOWNLOAD_ZRSP)
+				|| ntohl(readInt32(buff + 1)) != part.length) {
+				fprintf(stderr, "fail to get response from server!\n");
+				_exit(1);
+			}
+			_exit(recvAnyBody(0xff & buff[0], fd, lo, part.length));
+		}
+	}
+	while (wait(&status) > 0) {
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) {failed = 1;}
+	}
+	close(fd);
+	if (failed) {
+		fprintf(stderr, "fail to receive data from server!\n");
+		return 1;
+	}
+	fprintf(stdout, "...Downloaded data have been successfully written into '%s'\n", op->saveasfilename);
+	return 0;
+}
+
+int localChecksum(const char* file, int offset, int length, unsigned char md5_sum[] /* output checksum */ ) {
+	EVP_MD_CTX* c;
+	char buff[MAX_PACKET_SIZE];
+	int fd, n;
+	if ((fd = open(file, O_RDONLY)) == -1) {
+		return 1;
+	}
+	if (NULL == (c = EVP_MD_CTX_new()) || !EVP_DigestInit_ex(c, EVP_md5(), NULL)) {
+		EVP_MD_CTX_free(c);
+		close(fd);
+		return 1;
+	}
+	while (length > 0) {
+		if ((n = pread(fd, buff, length > sizeof(buff) ? sizeof(buff) : length, offset)) < 1
+			|| !EVP_DigestUpdate(c, buff, n)) {
+			EVP_MD_CTX_free(c);
+			close(fd);
+			return 1;
+		}
+		offset += n;
+		length -= n;
+	}
+	close(fd);
+	n = EVP_DigestFinal_ex(c, md5_sum, NULL);
+	EVP_MD_CTX_free(c);
+	return !n;
+}
+
+int remoteChecksum(const char* file, int offset, int length, unsigned char md5_sum[] /* output checksum */ ) {
+	char buff[MAX_PACKET_SIZE] = {0};
+	struct Op op;
+	int ret = 1;
+	memset(&op, 0, sizeof(op));
+	op.type = CHECKSUM_REQ;
+	op.offset = offset;
+	op.length = length;
+	strcpy(op.filename, file);
+	setConnectMode();
+	sendOp(&op);
+	if (!readMsg(buff) && (0xff & buff[0]) == CHECKSUM_RSP && ntohl(readInt32(buff + 1)) == 16) {
+		memcpy(md5_sum, buff + 5, 16);
+		ret = 0;
+	}
+	close(sock_fd);
+	return ret;
+}
+
+//continue from the end of the partial save file, once its tail matches the file on the server
+int resumeDownload(const struct Op* op) {
+	char buff[MAX_PACKET_SIZE] = {0};
+	unsigned char local[16], remote[16];
+	struct stat st;
+	struct Op rest = *op;
+	int size, total, have = 0, tail, fd, len, ret = 1;
+	if ((size = fileSize(op->filename)) < 0) {
+		return 1;
+	}
+	total = op->length > 0 ? op->length : size - op->offset;
+	if (stat(op->saveasfilename, &st) == 0) {
+		have = st.st_size > total ? total : st.st_size;
+	}
+	if (have > 0) {
+		tail = have > RESUME_CHECK_SIZE ? RESUME_CHECK_SIZE : have;
+		if (localChecksum(op->saveasfilename, have - tail, tail, local)
+			|| remoteChecksum(op->filename, op->offset + have - tail, tail, remote)
+			|| memcmp(local, remote, 16) != 0) {
+			fprintf(stdout, "...'%s' does not match the server, downloading from the start\n", op->saveasfilename);
+			have = 0;
+		}
+	}
+	if ((fd = open(op->saveasfilename, O_WRONLY | O_CREAT, 0644)) == -1 || ftruncate(fd, have) == -1) {
+		fprintf(stderr, "fail to open save file %s!\n", op->saveasfilename);
+		return 1;
+	}
+	if (have == total) {
+		close(fd);
+		fprintf(stdout, "...'%s' is already complete\n", op->saveasfilename);
+		return 0;
+	}
+	rest.offset = op->offset + have;
+	rest.length = total - have;
+	setConnectMode();
+	sendOp(&rest);
+	if (readData(buff, 5)) {
+		fprintf(stderr, "fail to get response from server!\n");
+	} else if ((0xff & buff[0]) == DOWNLOAD_RSP || (0xff & buff[0]) == DOWNLOAD_ZRSP) {
+		len = ntohl(readInt32(buff + 1));
+		if (len != rest.length) {
+			fprintf(stderr, "fail to get response from server!\n");
+		} else if (!(ret = recvAnyBody(0xff & buff[0], fd, have, len))) {
+			fprintf(stdout, "...Downloaded data have been successfully appended to '%s' from byte %d\n", op->saveasfilename, have);
+		}
+	} else if ((0xff & buff[0]) == DOWNLOAD_ERR) {
+		fprintf(stdout, "DOWNLOAD_ERR received from the server\n");
+	}
+	close(fd);
+	close(sock_fd);
+	return ret;
+}
+
+void recvOp(const struct Op* op) {
+	switch (op->type) {
+	case FILETYPE_REQ:
+		recvFiletype(op);
+		break;
+	case CHECKSUM_REQ:
+		recvChecksum(op);
+		break;
+	case CHECKSUM_TREE_REQ:
+		recvTreeChecksum(op);
+		break;
+	case DOWNLOAD_REQ:
+		recvDownload(op);
+		break;
+	}
+}
+
+int request(const char* command, int argc, char* argv[]) {
+	struct Op op;
+	if (parseOp(command, argc, argv, &op)) {
+		return 1;
+	}
+	if (op.type == DOWNLOAD_REQ && op.parallel > 1) {
+		return parallelDownload(&op);
+	}
+	if (op.type == DOWNLOAD_REQ && op.resume) {
+		return resumeDownload(&op);
+	}
+	setConnectMode();
+	sendOp(&op);
+	recvOp(&op);
+	close(sock_fd);
+	return 0;
+}
+
+//run every operation listed in listfile (one command per line, same syntax as the commandline)
+//over one TCP connection, keeping up to PIPELINE_DEPTH requests in flight
+int batch(int argc, char* argv[]) {
+	struct Op ops[PIPELINE_DEPTH];
+	char line[1024];
+	char* args[MAX_OP_ARGS];
+	int head = 0, tail = 0, n;
+	FILE* pf = stdin;
+	if (argc > 1) {
+		fprintf(stderr, "error: too much parameters\n");
+		return 1;
+	}
+	if (argc == 1 && NULL == (pf = fopen(argv[0], "r"))) {
+		fprintf(stderr, "fail to open list file %s!\n", argv[0]);
+		return 1;
+	}
+	setConnectMode();
+	for (;;) {
+		//fill the pipeline
+		while (tail - head < PIPELINE_DEPTH && fgets(line, sizeof(line), pf)) {
+			n = 0;
+			for (args[n] = strtok(line, " \t\r\n"); args[n] && n < MAX_OP_ARGS - 1; args[n] = strtok(NULL, " \t\r\n")) {
+				++n;
+			}
+			if (n == 0 || args[0][0] == '#') {continue;}
+			if (parseOp(args[0], n - 1, &args[1], &ops[tail % PIPELINE_DEPTH])) {continue;}
+			if (udp) {
+				fprintf(stderr, "error: -udp is not supported in batch mode\n");
+				udp = 0;
+				continue;
+			}
+			if (sendOp(&ops[tail % PIPELINE_DEPTH]) < 0) {
+				fprintf(stderr, "fail to send request to server!\n");
+				break;
+			}
+			++tail;
+		}
+		if (head == tail) {break;}
+		//responses come back in request order
+		recvOp(&ops[head++ % PIPELINE_DEPTH]);
+	}
 	close(sock_fd);
+	if (pf != stdin) {fclose(pf);}
 	return 0;
 }
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,51 +6,260 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <netinet/ip.h>
+#include <arpa/inet.h>
 #include <errno.h>
 #include <unistd.h>
 #include <signal.h>
-#include <openssl/md5.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <openssl/evp.h>
+#include <zlib.h>
+#include <math.h>
+#include <endian.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 #define FILETYPE_REQ 0xea // file-type request
 #define FILETYPE_RSP 0xe9 // successful file-type response
 #define FILETYPE_ERR 0xe8 // failed file-type response
 #define CHECKSUM_REQ 0xca // file checksum request
 #define CHECKSUM_RSP 0xc9 // successful checksum response
 #define CHECKSUM_ERR 0xc8 // failed checksum response
+#define CHECKSUM_AREQ 0xc7 // file checksum request naming the hash algorithm
+#define HASH_MD5 0x01 // CHECKSUM_AREQ hash algorithms
+#define HASH_SHA1 0x02
+#define HASH_SHA256 0x03
+#define HASH_SHA512_256 0x04
+#define HASH_BLAKE2S 0x05 // BLAKE2s-256
+#define HASH_BLAKE2B 0x06 // BLAKE2b-512
+#define HASH_READ (1 << 20) // bytes of one pread() of a checksum of a file that is not mapped
+#define CHECKSUM_TREE_REQ 0xda // chunked (Merkle tree) checksum request
+#define CHECKSUM_TREE_RSP 0xd9 // successful tree checksum response
+#define CHECKSUM_TREE_ERR 0xd8 // failed tree checksum response
+#define TREE_FLAG_LEAVES 0x01 // CHECKSUM_TREE_REQ flags: send the digest of every chunk after the root
+#define TREE_CHUNK (1 << 20) // default bytes of a tree checksum chunk
+#define TREE_CHUNK_MIN (1 << 12)
+#define TREE_CHUNK_MAX (1 << 30)
+#define TREE_LEAVES_MAX 65536 // chunks of one tree checksum; larger chunks are used past it
 #define DOWNLOAD_REQ 0xaa // download file request
 #define DOWNLOAD_RSP 0xa9 // successful download response
 #define DOWNLOAD_ERR 0xa8 // failed download response
+#define DOWNLOAD_ZREQ 0xa7 // download file request accepting a compressed body
+#define DOWNLOAD_ZRSP 0xa6 // successful download response with a deflate-compressed body
+#define ZCODEC_DEFLATE 0x01 // DOWNLOAD_ZREQ capability: zlib deflate stream
+#define FILESIZE_REQ 0xba // file size request
+#define FILESIZE_RSP 0xb9 // successful file size response
+#define FILESIZE_ERR 0xb8 // failed file size response
 #define UNKNOWN_FAIL 0x51 // catch-all failure response
 #define MAX_PACKET_SIZE 4096 //max size of a packet frame
 #define PACKET_RESERVE_SIZE 4
+#define DATAGRAM_MIN 1280 // smallest UDP datagram of a session, room for any response head
+#define DATAGRAM_MAX 65504 // largest UDP datagram, a multiple of 8 under the IPv4 limit of 65507
+#define IP_UDP_HEADERS 28 // IPv4 and UDP header bytes in front of a datagram
 #define MAXLINE 1024
+#define MAX_EVENTS 256 // epoll events handled per wakeup
+#define CHUNK_SIZE (1 << 16) // size of a download body chunk
+#define SENDFILE_SIZE (1 << 20) // max body bytes handed to one sendfile()
+#define ZFRAME_MAX (CHUNK_SIZE + (CHUNK_SIZE >> 3) + 1024) // max compressed bytes of one DOWNLOAD_ZRSP frame
+#define DEFLATE_LEVEL 3
+#define CONN_READ_HEAD 0 // waiting for the 5 bytes type+length header
+#define CONN_READ_BODY 1 // waiting for the rest of the request
+#define CONN_WRITE 2 // streaming the response
+#define CONN_HASHING 3 // a checksum request the hash pool answers
+#define MAX_WORKERS 256
+#define SESSION_BUCKETS 1024 // UDP session hash table size
+#define SESSION_MAX_RETRIES 20 // retransmissions of one packet before its UDP session is dropped
+#define DUPTHRESH 3 // ACKs of packets sent after a missing packet before it is resent without a timeout
+#define UDP_RCVBUF (4 << 20) // receive buffer of the UDP socket
+#define UDP_BATCH 64 // max packets handed to one sendmmsg()
+#define RTO_MIN 1000 // lower bound of the retransmission timeout, us
+#define RTO_MAX 5000000 // upper bound of the retransmission timeout after backoff, us
+#define RTO_GRANULARITY 1000 // clock granularity added to the RTO variance term, us
+#define RECV_WINDOW 1024 // packets a client buffers from its first missing one unless it tells (tclient RECV_RING)
+#define CWND_MAX RECV_WINDOW // upper bound of the congestion window, packets
+#define PACKET_POOL_MAX 8192 // free packet buffers kept for reuse
+#define PACE_QUANTUM 100 // us of paced packets released by one wakeup
+#define PACE_SS_GAIN 2.0 // pacing rate over cwnd/srtt in slow start
+#define PACE_CA_GAIN 1.2 // pacing rate over cwnd/srtt after slow start
+#define BUCKET_DEPTH 2000 // us of tokens a rate limit bucket holds, the largest burst it lets out
+#define BUCKET_QUANTUM 500 // us of tokens a session held back by a bucket waits for, not just one datagram
+#define CUBIC_C 0.4
+#define CUBIC_BETA 0.7
+#define BBR_STARTUP_GAIN 2.885 // 2/ln(2)
+#define BBR_CWND_GAIN 2.0
+#define BBR_BW_ROUNDS 10 // max delivery rate filter length, round trips
+#define BBR_RTT_WINDOW 10000000 // min RTT filter length, us
+#define TIMER_HEAP_INIT 1024 // initial capacity of the retransmission timer heap
+#define CACHE_BUCKETS 1024 // file cache hash table size
+#define CACHE_MAX_FILES 1024 // max open files kept by the file cache
+#define CACHE_REVALIDATE_MS 1000 // a cached file is checked against the disk at most this often
+#define CACHE_PATH_MAX 256 // file names the caches key entries by are shorter than this
+#define SUM_CACHE_MAX 4096 // max digests kept by the checksum cache
+#define SUM_PENDING 0 // checksum cache entry being hashed by one request, the others wait for it
+#define SUM_DONE 1
+#define SUM_FAILED 2
+#define ACK_SACK_SIZE 12 // SACK ACK: cumulative seq, flags, one or more 32-bit bitmap words
+#define ACK_FLAG_SACK 0x01 // ACK reserved field: the ACK carries a SACK bitmap, never set in a request
+#define ACK_FLAG_NAK 0x02 // ACK reserved field: the packet of this seq arrived corrupted, resend it now
+#define REQ_SIZE_MASK 0x0000fff8 // request reserved field: largest datagram the client accepts, 0 for MAX_PACKET_SIZE
+#define REQ_CAP_FEC 0x00010000 // request reserved field: the client can rebuild packets from XOR parity
+#define REQ_WINDOW_SHIFT 20 // request reserved field: packets the client buffers, from this bit up, 0 for RECV_WINDOW
+#define PACKET_FLAG_PARITY 0x80 // top byte of a data packet's reserved field: an XOR parity packet
+#define PACKET_FLAG_CRC 0x40 // top byte of a data packet's reserved field: a CRC32C of the packet follows it
+#define REQ_CAP_CRC 0x00020000 // request reserved field: the client checks a CRC32C trailer on every packet
+#define CRC_SIZE 4
+#define CRC32C_POLY 0x82f63b78 // Castagnoli, reflected
+#define FEC_GROUP_MAX 64 // max data packets covered by one parity packet
+#define INITIAL_SEQ 100001 // sequence number of the first packet of a UDP session
+#define NETEM_UNIFORM 0 // -netem dist: delay plus jitter times U(-1, 1)
+#define NETEM_NORMAL 1 // delay plus jitter times N(0, 1)
+#define NETEM_PARETO 2 // delay plus jitter times Pareto(3) - 1: a heavy tail of late packets
+#define NETEM_PARETO_ALPHA 3.0
+#define NETEM_QUEUE 1000 // default packets of the bottleneck queue, as netem's limit
+#define DELAY_HEAP_INIT 1024 // initial capacity of the heap of delayed datagrams
 
-// tserver [-udp loss_model] [-w window] [-r msinterval] [-d] [-t seconds] port
+// tserver [-udp loss_model] [-w window] [-r msinterval] [-cc algorithm] [-cctrace file] [-fec group] [-s size] [-pace] [-rate mbps] [-total mbps] [-netem spec] [-j workers [-pin]] [-hash threads] [-m megabytes] [-d] [-t seconds] port
 
 /*------------------------------------------------------------------------------*/ 
-long getFileLen(FILE* pf);
+struct Conn;
+struct Worker;
+struct Data_Packet;
+struct CacheEntry;
+struct CongestionOps;
+struct Delayed;
+struct SumEntry;
+struct HashAlgo;
+struct TreeJob;
 void setLossMode();
-int nextLossBit();
-const char* strToHex(const char* bytes);
+int nextLossBit(struct Conn* conn);
+long long nowMs();
+long long nowUs();
+const char* strToHex(const char* bytes, int n, char* buf);
 void writeInt32(char* buf, int val);
 int readInt32(const char* buf);
 void autoShutdown(int sig);
+void wantCacheStats(int sig);
+void printCacheStats();
+void pollCacheStats();
+unsigned int cacheHash(const char* file);
+void cacheUnlink(struct CacheEntry* entry);
+void cacheFree(struct CacheEntry* entry);
+void cacheEvict(long need);
+struct CacheEntry* cacheGet(const char* file);
+void cacheRelease(struct CacheEntry* entry);
+unsigned int sumHash(const char* file, int offset, int length);
+void sumUnlink(struct SumEntry* sum);
+void sumEvict();
+int treeChunk(struct TreeJob* job, int k, char* buf);
+void* hashWorker(void* arg);
+void startHashPool();
+int queueHash(struct Conn* conn);
+void finishHashed(struct Worker* worker);
+void treeRoot(unsigned char* nodes, int n, unsigned char root[]);
+int treeChecksum(const char* file, int offset, int length, int* chunk, int* count, unsigned char** leaves, unsigned char root[]);
 int validFileName(const char* file);
 int filetype(const char* file, char* out);
-int checksum(const char* file, int offset, int length, unsigned char md5_sum[]);
-FILE* download(const char* file, int offset, int* length);
-void ack_or_retransmission();
-int usend(const char* src, long length);
-int tsend(const char* src, long length);
-int trecv(char* dst, long max_length);
-int readData(char* buf, int length);
-int readMsg(char* buf);
-void respFiletype();
-void respChecksum();
-void respDownload();
-void TCPserver();
+const struct HashAlgo* hashFind(int id);
+int checksum(const char* file, int offset, int length, const struct HashAlgo* algo, unsigned char digest[], int* digest_len);
+struct CacheEntry* download(const char* file, int offset, int* length);
+void sendPackets(struct Conn* conn, struct Data_Packet** list, int n, const char* what);
+void sendPacket(struct Conn* conn, struct Data_Packet* packet, const char* what);
+uint32_t crc32cSoft(uint32_t crc, const char* buf, size_t len);
+uint32_t crc32cHard(uint32_t crc, const char* buf, size_t len);
+void crc32cInit();
+void crcSeal(struct Data_Packet* packet);
+void nakPacket(struct Conn* conn, int seq, long long now);
+double netemRandom();
+long long netemDelay();
+int parseNetem(const char* spec);
+void netemSend(struct Conn* conn, const char* data, int length, long long now);
+int delayBefore(int a, int b);
+int delayPush(struct Delayed* d);
+struct Delayed* delayPop();
+long long netemTimeout(long long now);
+void netemFlush(long long now);
+struct Data_Packet* packetAlloc(int size);
+void packetFree(struct Data_Packet* packet);
+int windowReserve(struct Conn* conn);
+void fixedInit(struct Conn* conn);
+void fixedAck(struct Conn* conn, long long rtt, long long now);
+void fixedLoss(struct Conn* conn, long long now);
+void renoInit(struct Conn* conn);
+void renoAck(struct Conn* conn, long long rtt, long long now);
+void renoLoss(struct Conn* conn, long long now);
+void cubicInit(struct Conn* conn);
+void cubicAck(struct Conn* conn, long long rtt, long long now);
+void cubicLoss(struct Conn* conn, long long now);
+void bbrInit(struct Conn* conn);
+void bbrAck(struct Conn* conn, long long rtt, long long now);
+void bbrLoss(struct Conn* conn, long long now);
+void ccClamp(struct Conn* conn);
+void ccLoss(struct Conn* conn, int seq, long long now);
+void traceCwnd(struct Conn* conn, long long now);
+void timerSwap(int a, int b);
+void timerUp(int k);
+void timerDown(int k);
+int timerPush(struct Data_Packet* packet);
+void timerRemove(struct Data_Packet* packet);
+long long timerTimeout(long long now);
+void markReady(struct Conn* conn);
+double bucketFill(double tokens, long long* stamp, double rate, int datagram, long long now);
+long long bucketTime(double tokens, double rate, int datagram, long long now);
+long long paceTime(struct Conn* conn, long long now);
+void paceSent(struct Conn* conn, int length, long long now);
+void paceHold(struct Conn* conn, long long at);
+void paceRelease(struct Conn* conn);
+long long paceTimeout(long long now);
+void paceWake(long long now);
+void rttSample(struct Conn* conn, long long rtt);
+void printRttStats(struct Conn* conn);
+int ackPacket(struct Conn* conn, int seq, long long now, long long* rtt, long long* newest);
+void fastRetransmit(struct Conn* conn, int high, long long newest, long long now);
+void recvAck(struct Conn* conn, const char* ack, int length);
+void xorBytes(char* dst, const char* src, int n);
+void fecAdd(struct Conn* conn, struct Data_Packet* packet);
+struct Data_Packet* fecParity(struct Conn* conn);
+void retransmission(long long now);
+int nextPayload(struct Conn* conn, char* dst, int max_length);
+int payloadDone(struct Conn* conn);
+int usend(struct Conn* conn);
+struct Conn* newConn(int fd);
+void resetConn(struct Conn* conn);
+void closeConn(struct Conn* conn);
+int fillChunk(struct Conn* conn);
+int compressChunk(struct Conn* conn, const char* src, int n);
+int sendBody(struct Conn* conn);
+int connRead(struct Conn* conn);
+int connWrite(struct Conn* conn);
+void connProgress(struct Conn* conn);
+int tsend(struct Conn* conn, const char* src, long length);
+unsigned int sessionHash(const struct sockaddr_in* addr);
+struct Conn* findSession(const struct sockaddr_in* addr);
+int pathMtu(const struct sockaddr_in* addr);
+struct Conn* newSession(const struct sockaddr_in* addr, unsigned int flags);
+void dropSession(struct Conn* conn);
+void recvDatagrams();
+void respFiletype(struct Conn* conn);
+void respChecksum(struct Conn* conn);
+void respTreeChecksum(struct Conn* conn);
+void respDownload(struct Conn* conn);
+void respFilesize(struct Conn* conn);
+void handleMsg(struct Conn* conn);
+void TCPserver(struct Worker* worker);
 void UDPserver();
 void setServeMode();
-int taccept();
+void acceptConns(struct Worker* worker);
+void* serveTCP(void* arg);
+void serveUDP();
 void serve();
 void parseArg(int argc, char* argv[]);
 
@@ -58,6 +268,8 @@ static int shutdown_time = 300;
 int main(int argc, char* argv[]) {
         parseArg(argc, argv);
         signal(SIGALRM, autoShutdown);
+        signal(SIGUSR1, wantCacheStats);
+        signal(SIGPIPE, SIG_IGN); // sendfile() cannot take MSG_NOSIGNAL; a client gone mid-body must not kill the server
         alarm(shutdown_time);
         serve();
         return 0;
@@ -66,64 +278,365 @@ int main(int argc, char* argv[]) {
 
 struct Data_Packet {
     char* data;
+    int size; // bytes allocated for data
     int length;
-    int empty;
-}
+    int seq;
+    struct Conn* conn; // session owning the window slot
+    long long sent; // us time of the last transmission
+    long long rto; // us timeout the packet's timer was armed with
+    long long deadline; // us time the packet is resent if still unacked
+    int heap_idx; // position in the timer heap, -1 when not armed
+    int retries; // retransmissions of this packet
+    int dupacks; // ACKs of packets sent after it since its last transmission
+    struct Data_Packet* next; // packet pool free list
+};
+
+// a copy of a datagram held back by the -netem impairments
+struct Delayed {
+    long long due; // us time it is handed to the socket
+    long order; // FIFO order of datagrams due at the same time
+    struct sockaddr_in peer;
+    int length;
+    char data[];
+};
+
+// -netem impairments of the path from the server to every client; each session has its own
+// Gilbert-Elliott state and bottleneck queue
+struct Netem {
+    int on;
+    double delay; // us
+    double jitter; // us
+    int dist; // NETEM_UNIFORM, NETEM_NORMAL or NETEM_PARETO
+    double reorder; // probability that a datagram skips the delay
+    double dup; // probability that a datagram is sent twice
+    double rate; // bottleneck bytes/us, 0 for none
+    int queue; // datagrams the bottleneck queue holds
+    double ge_p; // Gilbert-Elliott: probability of going from the good to the bad state
+    double ge_r; // probability of going from the bad to the good state
+    double ge_bad; // loss probability in the bad state
+    double ge_good; // loss probability in the good state
+    double corrupt; // probability that a bit of a datagram is flipped
+};
+
+// a congestion control algorithm; cwnd and ssthresh are counted in packets
+struct CongestionOps {
+    const char* name;
+    void (*init)(struct Conn* conn);
+    void (*ack)(struct Conn* conn, long long rtt, long long now); // rtt < 0: no valid sample (Karn)
+    void (*loss)(struct Conn* conn, long long now); // called once per loss event
+};
+
+// an open file shared by all requests for it, validated by inode/mtime/size
+struct CacheEntry {
+    char path[CACHE_PATH_MAX];
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+    char* map; // whole file content, NULL if it does not fit the budget
+    long long checked; // ms time of the last stat() against the disk
+    int refs; // requests using the entry
+    int stale; // unlinked from the cache, freed with its last reference
+    struct CacheEntry* hnext; // hash chain
+    struct CacheEntry* prev; // LRU list, most recently used first
+    struct CacheEntry* next;
+};
+
+// a hash algorithm a CHECKSUM_AREQ can name; OpenSSL picks the fastest code the CPU runs
+struct HashAlgo {
+    int id;
+    const char* name;
+    const EVP_MD* (*md)(void);
+};
+
+// digest of a range of one version of a file
+struct SumEntry {
+    char path[CACHE_PATH_MAX];
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    off_t size;
+    int offset;
+    int length;
+    const struct HashAlgo* algo;
+    int state; // SUM_PENDING, SUM_DONE or SUM_FAILED
+    int refs; // requests waiting for the digest
+    int stale; // unlinked from the cache, freed with its last reference
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    int digest_len;
+    struct SumEntry* hnext; // hash chain
+    struct SumEntry* prev; // LRU list, most recently used first
+    struct SumEntry* next;
+};
+
+// the chunks of one CHECKSUM_TREE request, hashed by the requesting thread and the hash pool
+struct TreeJob {
+    struct CacheEntry* entry;
+    off_t offset;
+    long length;
+    int chunk; // bytes of every chunk but the last
+    int count; // chunks
+    int next; // next chunk nobody has taken, tree_lock held
+    int done; // chunks hashed, tree_lock held
+    int failed;
+    unsigned char* leaves; // MD5 of every chunk
+    struct TreeJob* qnext; // hash pool queue
+};
+
+// one event loop thread with its own listening socket
+struct Worker {
+    int id;
+    pthread_t thread;
+    int socket_fd;
+    int epoll_fd;
+    int event_fd; // the hash pool signals answered checksum requests
+    pthread_mutex_t lock;
+    struct Conn* hashed; // checksum requests the hash pool has answered, chained by qnext
+};
+
+// state of one client request/response exchange
+struct Conn {
+    int fd;
+    int state;
+    int packet_seq; // UDP packet sequence number
+    char buff[MAX_PACKET_SIZE]; // request message
+    int in_len; // bytes of the request received so far
+    int in_need; // bytes of the request expected so far
+    char out[MAXLINE]; // response head (or a whole short response)
+    int out_len;
+    int out_sent;
+    struct CacheEntry* entry; // download body source
+    off_t file_off; // file offset of the next body byte to read
+    long body_left; // body bytes not yet read from the file
+    int copy_body; // sendfile() is not usable, copy the body through chunk
+    z_stream* zs; // compressor of a DOWNLOAD_ZRSP body
+    char* zchunk; // buffer for one compressed frame
+    char* chunk; // buffer for body bytes read from the file
+    const char* chunk_data; // body bytes not yet sent, in chunk or in the file mapping
+    int chunk_len;
+    int chunk_sent;
+    unsigned char* leaves; // CHECKSUM_TREE_RSP chunk digests, sent as the body
+    struct sockaddr_in peer; // UDP session peer
+    struct Data_Packet** window; // UDP unacked packets, indexed by seq % window_cap
+    int window_cap;
+    int rwnd; // max sequence span from the oldest unacked to the newest packet, the client's window
+    int datagram; // largest UDP datagram of the session, bytes
+    int snd_una; // oldest unacked sequence number
+    int inflight; // unacked packets
+    long loss_bit; // UDP loss model cursor
+    uint64_t loss_word; // model bits from loss_bit on, the next one in the top bit
+    int loss_left; // bits of loss_word not used yet
+    int ready; // on the ready list: window slots were freed or the session is new
+    int failed; // a packet ran out of retransmissions
+    long long srtt; // smoothed round trip time, us (0 before the first sample)
+    long long rttvar; // round trip time variation, us
+    long long rto; // retransmission timeout of new packets, us
+    long long rtt_min; // RTT statistics for debug mode, us
+    long long rtt_max;
+    long rtt_samples;
+    long timeouts;
+    long fast_retransmits;
+    long nak_resends; // packets resent because the client found them corrupted
+    int crc; // every packet ends with a CRC32C of the rest of it
+    double cwnd; // congestion window, packets
+    double ssthresh;
+    int recover_seq; // a loss of a packet sent before this seq belongs to the last loss event
+    double w_max; // CUBIC: window before the last reduction
+    double cubic_k; // CUBIC: time to grow back to w_max, s
+    double w_origin; // CUBIC: plateau of the current cubic curve
+    double w_est; // CUBIC: Reno-friendly window estimate
+    long long epoch; // CUBIC: us time the current growth epoch started, 0 if none
+    long delivered; // BBR: packets acked so far
+    long round_delivered; // BBR: delivered at the start of the current round trip
+    int round_seq; // BBR: the round trip ends when a packet from this seq on is acked
+    long long round_start; // BBR: us
+    long rounds;
+    double bw[BBR_BW_ROUNDS]; // BBR: delivery rate of recent round trips, packets per us
+    double btl_bw; // BBR: max of bw
+    double full_bw; // BBR: bandwidth the startup phase last grew past
+    int full_bw_count; // BBR: rounds without 25% growth
+    int startup; // BBR: still in the startup phase
+    long long min_rtt; // BBR: us
+    long long min_rtt_stamp;
+    int fec; // data packets per XOR parity packet, 0 without FEC
+    struct Data_Packet* fec_parity; // parity of the current group
+    int fec_first; // seq of the first packet of the current group
+    int fec_count; // packets in the current group
+    int fec_len; // XOR of the payload lengths of the group
+    int fec_max; // longest payload of the group
+    int ge_state; // -netem Gilbert-Elliott state of the path, 1 when bad
+    double link_free; // us time the -netem bottleneck has sent every datagram queued on it
+    double pace_next; // us time the pacing gap lets the next packet go
+    double tokens; // -rate bucket, bytes
+    long long tokens_stamp; // us time the bucket was last filled
+    long long pace_at; // us time a held back session is served again, 0 if not held
+    struct Conn* pnext; // paced_sessions chain
+    double traced_cwnd; // last values written to the trace file
+    double traced_ssthresh;
+    struct Conn* hnext; // UDP session hash chain
+    struct Conn* next; // UDP ready list
+    struct Worker* worker; // TCP event loop of the connection
+    struct Conn* qnext; // hash_queue chain, then the worker's hashed chain
+};
 
 // UDP variables 
 static int udp = 0;
 static char loss_model[256];
 static int window_size = 3;
 static int msinterval = 250;
-static struct Data_Packet * packets;
-static FILE* pf_loss;
-static unsigned char byte;
-static int bit = 0;
+static int fec_group = 0; // -fec: data packets per parity packet, 0 for none
+static int datagram_max = DATAGRAM_MAX; // -s: largest UDP datagram sent
+static int pacing = 0; // -pace: spread each window over the smoothed RTT
+static double session_rate = 0; // -rate: bytes/us of one session, 0 for no limit
+static double total_rate = 0; // -total: bytes/us of all sessions together, 0 for no limit
+static double total_tokens = 0; // -total bucket, bytes
+static long long total_stamp = 0;
+static struct Netem netem = {0, 0, 0, NETEM_UNIFORM, 0, 0, 0, NETEM_QUEUE, 0, 0, 1, 0, 0};
+static uint32_t crc32c_table[256];
+static uint32_t (*crc32cUpdate)(uint32_t crc, const char* buf, size_t len) = crc32cSoft;
+static uint64_t netem_rng = 1; // splitmix64 state, -netem seed
+static struct Delayed** delay_heap; // datagrams held back by -netem, min-heap on due
+static int delay_count = 0;
+static int delay_cap = 0;
+static long delay_order = 0;
+static uint64_t* loss_words; // the loss model, first byte in the top bits of the first word
+static long loss_bits; // bits in the loss model
+static struct Conn* session_table[SESSION_BUCKETS];
+static struct CongestionOps cc_list[] = {
+    {"fixed", fixedInit, fixedAck, fixedLoss},
+    {"reno", renoInit, renoAck, renoLoss},
+    {"cubic", cubicInit, cubicAck, cubicLoss},
+    {"bbr", bbrInit, bbrAck, bbrLoss}
+};
+#define CC_COUNT (sizeof(cc_list) / sizeof(cc_list[0]))
+static struct CongestionOps* cc = &cc_list[0];
+static char cc_trace[256]; // congestion window trace file name
+static FILE* pf_cctrace;
+static struct Data_Packet* packet_pool; // free packet buffers
+static int packet_pool_size = 0;
+static struct Conn* ready_sessions; // UDP sessions to be served by the event loop
+static struct Conn* paced_sessions; // UDP sessions held back by pacing or a rate limit until their pace_at
+static struct Data_Packet** timer_heap; // unacked packets, min-heap on deadline
+static int timer_count = 0;
+static int timer_cap = 0;
 
-static int packet_seq = 100001; // packet sequence number
-static char buff[MAX_PACKET_SIZE];
 static int debug_mode = 0;
+static volatile sig_atomic_t stats_wanted = 0; // SIGUSR1 arrived; the next event loop to wake prints the cache counters
 static int port;
 static int socket_fd;
-static int connect_fd;
+static int workers = 1; // TCP event loop threads
+static int pin_cpu = 0; // pin each worker to a CPU
+static struct Worker worker_list[MAX_WORKERS];
 static struct sockaddr_in servaddr;
-static struct sockaddr_in clientaddr;
 
-long getFileLen(FILE* pf) {
-    fseek(pf, 0, SEEK_END);
-    return ftell(pf);
-}
+// file cache
+static long cache_budget = 256L << 20; // max bytes of mapped file content
+static long cache_mapped = 0;
+static int cache_files = 0;
+static long cache_hits = 0;
+static long cache_misses = 0;
+static long cache_evictions = 0;
+static struct CacheEntry* cache_table[CACHE_BUCKETS];
+static struct CacheEntry* cache_lru_head;
+static struct CacheEntry* cache_lru_tail;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
 
+static struct HashAlgo hash_list[] = {
+    {HASH_MD5, "md5", EVP_md5},
+    {HASH_SHA1, "sha1", EVP_sha1},
+    {HASH_SHA256, "sha256", EVP_sha256},
+    {HASH_SHA512_256, "sha512-256", EVP_sha512_256},
+    {HASH_BLAKE2S, "blake2s", EVP_blake2s256},
+    {HASH_BLAKE2B, "blake2b", EVP_blake2b512}
+};
+#define HASH_COUNT (sizeof(hash_list) / sizeof(hash_list[0]))
+
+// checksum cache
+static int sum_entries = 0;
+static long sum_hits = 0;
+static long sum_misses = 0;
+static long sum_waits = 0; // requests that shared the digest of an identical one being hashed
+static long sum_bytes = 0; // bytes hashed
+static struct SumEntry* sum_table[CACHE_BUCKETS];
+static struct SumEntry* sum_lru_head;
+static struct SumEntry* sum_lru_tail;
+static pthread_mutex_t sum_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sum_cond = PTHREAD_COND_INITIALIZER;
+
+// hash pool
+static int hash_threads = 0; // hash pool threads, answering TCP checksum requests and hashing tree chunks; 0 for one per CPU
+static struct TreeJob* tree_queue; // tree checksums with chunks nobody has taken yet
+static pthread_mutex_t tree_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tree_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t tree_done = PTHREAD_COND_INITIALIZER;
+static struct Conn* hash_queue; // TCP checksum requests no hash thread has taken yet, tree_lock held
+static struct Conn** hash_tail = &hash_queue;
+
+// read the whole loss model once into big-endian 64-bit words
 void setLossMode() {
-    if (loss_model[0]) {
-        pf_loss = fopen(loss_model, "rb");
-        byte = 0;
+    FILE* pf;
+    long len, k;
+    if (!loss_model[0]) {return;} 
+    if (NULL == (pf = fopen(loss_model, "rb"))) {
+        fprintf(stderr, "open %s error: %s(errno: %d)\n", loss_model, strerror(errno), errno);
+        exit(1);
     }
+    fseek(pf, 0, SEEK_END);
+    len = ftell(pf);
+    rewind(pf);
+    if (len <= 0) {
+        fclose(pf);
+        return;
+    }
+    if (NULL == (loss_words = (uint64_t* ) calloc((len + 7) / 8, sizeof(uint64_t)))
+        || fread(loss_words, 1, len, pf) != (size_t) len) {
+        fprintf(stderr, "read %s error: %s(errno: %d)\n", loss_model, strerror(errno), errno);
+        exit(1);
+    }
+    fclose(pf);
+    for (k = 0; k < (len + 7) / 8; ++k) {
+        loss_words[k] = be64toh(loss_words[k]);
+    }
+    loss_bits = len * 8;
 }
 
-int nextLossBit() {
-    int filelen, b;
-    if (NULL == pf_loss) return 1;
-    if (!(bit & 7)) {
-        filelen = getFileLen(pf_loss);
-        if (filelen >= bit / 8) {
-            fseek(pf_loss, 0, SEEK_SET);
-            bit = 0;
-        }
-        fread(&byte, 1, 1, pf_loss);
+// every session walks the loss model with its own cursor: its next bit, the left-most bit of
+// each byte first, from the beginning again after the last one; 1 sends the packet
+int nextLossBit(struct Conn* conn) {
+    int bit;
+    if (NULL == loss_words) {return 1;} 
+    if (conn->loss_left == 0) {
+        if (conn->loss_bit >= loss_bits) {conn->loss_bit = 0;} 
+        conn->loss_word = loss_words[conn->loss_bit >> 6] << (conn->loss_bit & 63);
+        conn->loss_left = 64 - (conn->loss_bit & 63);
+        if (conn->loss_left > loss_bits - conn->loss_bit) {conn->loss_left = loss_bits - conn->loss_bit;} 
+        conn->loss_bit += conn->loss_left;
     }
-    b = (byte >> (bit & 7)) & 1;
-    bit++;
-    return b;
+    bit = conn->loss_word >> 63;
+    conn->loss_word <<= 1;
+    --conn->loss_left;
+    return bit;
 }
 
-const char* strToHex(const char* bytes) {
-    static char buf[33] = "";
+long long nowMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+long long nowUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+const char* strToHex(const char* bytes, int n, char* buf /* at least 2n+1 bytes */ ) {
     int k;
-    for (k = 0; k < 16; ++k) {
+    for (k = 0; k < n; ++k) {
         sprintf(buf + 2 * k, "%02x", (0xff & bytes[k]));
     }
-    buf[32] = '\0';
+    buf[2 * n] = '\0';
     return buf;
 }
 
@@ -141,20 +654,205 @@ void autoShutdown(int sig) {
     int k;
     if (debug_mode) {
         fprintf(stdout, "%d seconds timer has expired. Sever has auto-shutdown.\n", shutdown_time);
-    }
-    if (connect_fd) {
-        shutdown(connect_fd, SHUT_RDWR);
+        printCacheStats();
     }
     if (socket_fd) {
         close(socket_fd);
     }
-    for (k = 0; udp && k < window_size; ++k) {
-        free(packets[k].data);
+    for (k = 0; k < workers; ++k) {
+        if (worker_list[k].socket_fd) {
+            close(worker_list[k].socket_fd);
+        }
     }
     fflush(stdout);
     exit(0);
 }
 
+// stdio is not async-signal-safe, so the handler only raises a flag for the event loops
+void wantCacheStats(int sig) {
+    stats_wanted = 1;
+}
+
+void printCacheStats() {
+    fprintf(stdout, "file cache: %ld hits, %ld misses, %ld evictions, %d files, %ld bytes mapped\n",
+        cache_hits, cache_misses, cache_evictions, cache_files, cache_mapped);
+    fprintf(stdout, "checksum cache: %ld hits, %ld misses, %ld waits, hit ratio %.1f%%, %d digests, %ld bytes hashed\n",
+        sum_hits, sum_misses, sum_waits,
+        sum_hits + sum_waits + sum_misses ? 100.0 * (sum_hits + sum_waits) / (sum_hits + sum_waits + sum_misses) : 0.0,
+        sum_entries, sum_bytes);
+    fflush(stdout);
+}
+
+// called by the event loops after every wakeup; only one of them prints
+void pollCacheStats() {
+    if (stats_wanted && __sync_lock_test_and_set(&stats_wanted, 0)) {printCacheStats();} 
+}
+
+unsigned int cacheHash(const char* file) {
+    unsigned int h = 5381;
+    for (; *file; ++file) {
+        h = h * 33 + (unsigned char) *file;
+    }
+    return h % CACHE_BUCKETS;
+}
+
+// take an entry out of the hash table and the LRU list, cache_lock held
+void cacheUnlink(struct CacheEntry* entry) {
+    struct CacheEntry** pp;
+    for (pp = &cache_table[cacheHash(entry->path)]; *pp; pp = &(*pp)->hnext) {
+        if (*pp == entry) {
+            *pp = entry->hnext;
+            break;
+        }
+    }
+    if (entry->prev) {entry->prev->next = entry->next;} else {cache_lru_head = entry->next;} 
+    if (entry->next) {entry->next->prev = entry->prev;} else {cache_lru_tail = entry->prev;} 
+    entry->stale = 1;
+    cache_files--;
+    if (entry->map) {cache_mapped -= entry->size;} 
+}
+
+void cacheFree(struct CacheEntry* entry) {
+    if (entry->map) {munmap(entry->map, entry->size);} 
+    close(entry->fd);
+    free(entry);
+}
+
+// drop least recently used idle entries until need more bytes fit the budget, cache_lock held
+void cacheEvict(long need) {
+    struct CacheEntry* entry;
+    struct CacheEntry* prev;
+    for (entry = cache_lru_tail; entry && (cache_mapped + need > cache_budget || cache_files >= CACHE_MAX_FILES); entry = prev) {
+        prev = entry->prev;
+        if (entry->refs) {continue;} 
+        cacheUnlink(entry);
+        cacheFree(entry);
+        cache_evictions++;
+    }
+}
+
+// get a referenced entry for file, opening and mapping it on a miss
+struct CacheEntry* cacheGet(const char* file) {
+    struct CacheEntry* entry;
+    struct stat st;
+    long long now = nowMs();
+    int fd;
+    //a longer name, such as one padded with ./ components, is not served rather than truncated
+    if (strlen(file) >= CACHE_PATH_MAX) {return NULL;} 
+    pthread_mutex_lock(&cache_lock);
+    for (entry = cache_table[cacheHash(file)]; entry; entry = entry->hnext) {
+        if (strcmp(entry->path, file) == 0) {break;} 
+    }
+    if (entry && now - entry->checked >= CACHE_REVALIDATE_MS) {
+        if (stat(file, &st) == 0 && st.st_dev == entry->dev && st.st_ino == entry->ino && st.st_size == entry->size
+            && st.st_mtim.tv_sec == entry->mtime.tv_sec && st.st_mtim.tv_nsec == entry->mtime.tv_nsec) {
+            entry->checked = now;
+        } else {
+            //changed on disk
+            cacheUnlink(entry);
+            if (!entry->refs) {cacheFree(entry);} 
+            entry = NULL;
+        }
+    }
+    if (entry) {
+        cache_hits++;
+        if (entry->prev) {
+            //move to the front of the LRU list
+            entry->prev->next = entry->next;
+            if (entry->next) {entry->next->prev = entry->prev;} else {cache_lru_tail = entry->prev;} 
+            entry->prev = NULL;
+            entry->next = cache_lru_head;
+            cache_lru_head->prev = entry;
+            cache_lru_head = entry;
+        }
+        entry->refs++;
+        pthread_mutex_unlock(&cache_lock);
+        return entry;
+    }
+    cache_misses++;
+    if ((fd = open(file, O_RDONLY)) == -1 || fstat(fd, &st) == -1
+        || NULL == (entry = (struct CacheEntry* ) calloc(1, sizeof(struct CacheEntry)))) {
+        fprintf(stderr, "fail to open file %s\n", file);
+        if (fd != -1) {close(fd);} 
+        pthread_mutex_unlock(&cache_lock);
+        return NULL;
+    }
+    strcpy(entry->path, file);
+    entry->fd = fd;
+    entry->dev = st.st_dev;
+    entry->ino = st.st_ino;
+    entry->mtime = st.st_mtim;
+    entry->size = st.st_size;
+    entry->checked = now;
+    entry->refs = 1;
+    if (st.st_size > 0 && st.st_size <= cache_budget) {
+        cacheEvict(st.st_size);
+        if (cache_mapped + st.st_size <= cache_budget) {
+            entry->map = (char* ) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (entry->map == MAP_FAILED) {
+                entry->map = NULL;
+            } else {
+                cache_mapped += st.st_size;
+            }
+        }
+    } else {
+        cacheEvict(0);
+    }
+    entry->hnext = cache_table[cacheHash(file)];
+    cache_table[cacheHash(file)] = entry;
+    entry->next = cache_lru_head;
+    if (cache_lru_head) {cache_lru_head->prev = entry;} else {cache_lru_tail = entry;} 
+    cache_lru_head = entry;
+    cache_files++;
+    pthread_mutex_unlock(&cache_lock);
+    return entry;
+}
+
+void cacheRelease(struct CacheEntry* entry) {
+    pthread_mutex_lock(&cache_lock);
+    if (--entry->refs == 0 && entry->stale) {
+        cacheFree(entry);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+unsigned int sumHash(const char* file, int offset, int length) {
+    unsigned int h = 5381;
+    for (; *file; ++file) {
+        h = h * 33 + (unsigned char) *file;
+    }
+    h = h * 33 + (unsigned int) offset;
+    h = h * 33 + (unsigned int) length;
+    return h % CACHE_BUCKETS;
+}
+
+// take a digest out of the hash table and the LRU list, sum_lock held
+void sumUnlink(struct SumEntry* sum) {
+    struct SumEntry** pp;
+    for (pp = &sum_table[sumHash(sum->path, sum->offset, sum->length)]; *pp; pp = &(*pp)->hnext) {
+        if (*pp == sum) {
+            *pp = sum->hnext;
+            break;
+        }
+    }
+    if (sum->prev) {sum->prev->next = sum->next;} else {sum_lru_head = sum->next;} 
+    if (sum->next) {sum->next->prev = sum->prev;} else {sum_lru_tail = sum->prev;} 
+    sum->stale = 1;
+    sum_entries--;
+}
+
+// drop least recently used digests nobody waits for until one more fits, sum_lock held
+void sumEvict() {
+    struct SumEntry* sum;
+    struct SumEntry* prev;
+    for (sum = sum_lru_tail; sum && sum_entries >= SUM_CACHE_MAX; sum = prev) {
+        prev = sum->prev;
+        if (sum->refs || sum->state == SUM_PENDING) {continue;} 
+        sumUnlink(sum);
+        free(sum);
+    }
+}
+
 int validFileName(const char * file) {
     char valid_chars[] = "+-_.,/";
     for (; *file; ++file) {
@@ -184,227 +882,1664 @@ int filetype(const char *file, char *out) {
 					*tmp = ' ';
 				} 
             }
-            strcat(out, buf);
+            strcat(out, buf);
+        }
+        pclose(pfp);
+        return 0;
+    }
+}
+
+const struct HashAlgo* hashFind(int id) {
+    int k;
+    for (k = 0; k < HASH_COUNT; ++k) {
+        if (hash_list[k].id == id) {return &hash_list[k];} 
+    }
+    return NULL;
+}
+
+// digests are cached by file version, range and algorithm; identical requests arriving while one
+// of them is hashing wait for its digest instead of reading the file again
+int checksum(const char* file, int offset, int length, const struct HashAlgo* algo,
+    unsigned char digest[] /* EVP_MAX_MD_SIZE bytes */, int* digest_len) {
+    EVP_MD_CTX* c;
+    void* buf = NULL;
+    unsigned int len;
+    struct CacheEntry* entry;
+    struct SumEntry* sum;
+    off_t pos;
+    int n, left, result;
+    //digests are keyed by the whole name, which must fit sum->path untruncated
+    if (strlen(file) >= CACHE_PATH_MAX || NULL == (entry = cacheGet(file))) {
+        return 1;
+    }
+    if (offset >= entry->size) {
+        fprintf(stderr, "Error: offset is larger or equal to the size of the file\n");
+        cacheRelease(entry);
+        return 1;
+    }
+    if (length < 0) {
+        length = entry->size - offset;
+    } else {
+        if ((off_t) offset + length > entry->size) {
+            fprintf(stderr, "Error: offset+length is larger or equal to the size of the file\n");
+            cacheRelease(entry);
+            return 1;
+        }
+    }
+    pthread_mutex_lock(&sum_lock);
+    for (sum = sum_table[sumHash(file, offset, length)]; sum; sum = sum->hnext) {
+        if (sum->offset == offset && sum->length == length && sum->algo == algo && sum->ino == entry->ino && sum->dev == entry->dev
+            && sum->size == entry->size && sum->mtime.tv_sec == entry->mtime.tv_sec
+            && sum->mtime.tv_nsec == entry->mtime.tv_nsec && strcmp(sum->path, file) == 0) {
+            break;
+        }
+    }
+    if (sum) {
+        if (sum->state == SUM_PENDING) {
+            sum_waits++;
+            sum->refs++;
+            while (sum->state == SUM_PENDING) {
+                pthread_cond_wait(&sum_cond, &sum_lock);
+            }
+            sum->refs--;
+        } else {
+            sum_hits++;
+        }
+        if ((result = sum->state != SUM_DONE)) {
+            if (!sum->refs && sum->stale) {free(sum);} 
+        } else {
+            memcpy(digest, sum->digest, sum->digest_len);
+            *digest_len = sum->digest_len;
+            if (sum->prev && !sum->stale) {
+                //move to the front of the LRU list
+                sum->prev->next = sum->next;
+                if (sum->next) {sum->next->prev = sum->prev;} else {sum_lru_tail = sum->prev;} 
+                sum->prev = NULL;
+                sum->next = sum_lru_head;
+                sum_lru_head->prev = sum;
+                sum_lru_head = sum;
+            }
+        }
+        pthread_mutex_unlock(&sum_lock);
+        cacheRelease(entry);
+        return result;
+    }
+    sum_misses++;
+    sumEvict();
+    if (NULL != (sum = (struct SumEntry* ) calloc(1, sizeof(struct SumEntry)))) {
+        strcpy(sum->path, file);
+        sum->dev = entry->dev;
+        sum->ino = entry->ino;
+        sum->mtime = entry->mtime;
+        sum->size = entry->size;
+        sum->offset = offset;
+        sum->length = length;
+        sum->algo = algo;
+        sum->state = SUM_PENDING;
+        sum->hnext = sum_table[sumHash(file, offset, length)];
+        sum_table[sumHash(file, offset, length)] = sum;
+        sum->next = sum_lru_head;
+        if (sum_lru_head) {sum_lru_head->prev = sum;} else {sum_lru_tail = sum;} 
+        sum_lru_head = sum;
+        sum_entries++;
+    }
+    pthread_mutex_unlock(&sum_lock);
+    left = length;
+    if (NULL != (c = EVP_MD_CTX_new()) && EVP_DigestInit_ex(c, algo->md(), NULL)) {
+        if (entry->map) {
+            if (EVP_DigestUpdate(c, entry->map + offset, length)) {left = 0;} 
+        } else if (0 == posix_memalign(&buf, 4096, length > HASH_READ ? HASH_READ : length)) {
+            //large page-aligned reads, not one packet at a time
+            for (pos = offset; left > 0; pos += n) {
+                n = pread(entry->fd, buf, left > HASH_READ ? HASH_READ : left, pos);
+                if (n < 1 || !EVP_DigestUpdate(c, buf, n)) {break;} 
+                left -= n;
+            }
+            free(buf);
+        }
+        if (!EVP_DigestFinal_ex(c, digest, &len) && left == 0) {left = length;} 
+        *digest_len = len;
+    }
+    EVP_MD_CTX_free(c);
+    cacheRelease(entry);
+    result = left > 0;
+    pthread_mutex_lock(&sum_lock);
+    sum_bytes += length - left;
+    if (sum) {
+        if (result) {
+            //a short read: nothing to share, the waiters fail too
+            sum->state = SUM_FAILED;
+            sumUnlink(sum);
+            if (!sum->refs) {free(sum);} 
+        } else {
+            memcpy(sum->digest, digest, *digest_len);
+            sum->digest_len = *digest_len;
+            sum->state = SUM_DONE;
+        }
+        pthread_cond_broadcast(&sum_cond);
+    }
+    pthread_mutex_unlock(&sum_lock);
+    return result;
+}
+
+// MD5 of chunk k of the job; 1 on a short read
+int treeChunk(struct TreeJob* job, int k, char* buf /* CHUNK_SIZE bytes */ ) {
+    EVP_MD_CTX* c;
+    off_t pos = job->offset + (off_t) k * job->chunk;
+    long left = job->length - (long) k * job->chunk;
+    int n;
+    if (left > job->chunk) {left = job->chunk;} 
+    if (job->entry->map) {
+        return !EVP_Digest(job->entry->map + pos, left, job->leaves + 16 * k, NULL, EVP_md5(), NULL);
+    }
+    if (NULL == (c = EVP_MD_CTX_new())) {return 1;} 
+    if (EVP_DigestInit_ex(c, EVP_md5(), NULL)) {
+        for (; left > 0; pos += n, left -= n) {
+            if ((n = pread(job->entry->fd, buf, left > CHUNK_SIZE ? CHUNK_SIZE : left, pos)) < 1) {break;} 
+            if (!EVP_DigestUpdate(c, buf, n)) {break;} 
+        }
+        if (!EVP_DigestFinal_ex(c, job->leaves + 16 * k, NULL)) {left = 1;} 
+    }
+    EVP_MD_CTX_free(c);
+    return left > 0;
+}
+
+// take chunks of the oldest queued tree checksum, one at a time, and answer queued TCP checksum
+// requests when no chunk is waiting. A thread only blocks in checksum() or treeChecksum() on
+// work another running thread is hashing, so the pool cannot wait on itself
+void* hashWorker(void* arg) {
+    char buf[CHUNK_SIZE];
+    struct TreeJob* job;
+    struct Conn* conn;
+    int k, failed;
+    pthread_mutex_lock(&tree_lock);
+    for (;;) {
+        while (NULL == tree_queue && NULL == hash_queue) {
+            pthread_cond_wait(&tree_work, &tree_lock);
+        }
+        if (NULL == tree_queue) {
+            conn = hash_queue;
+            if (NULL == (hash_queue = conn->qnext)) {hash_tail = &hash_queue;} 
+            pthread_mutex_unlock(&tree_lock);
+            handleMsg(conn);
+            pthread_mutex_lock(&conn->worker->lock);
+            conn->qnext = conn->worker->hashed;
+            conn->worker->hashed = conn;
+            pthread_mutex_unlock(&conn->worker->lock);
+            eventfd_write(conn->worker->event_fd, 1);
+            pthread_mutex_lock(&tree_lock);
+            continue;
+        }
+        job = tree_queue;
+        k = job->next++;
+        if (job->next == job->count) {tree_queue = job->qnext;} 
+        pthread_mutex_unlock(&tree_lock);
+        failed = treeChunk(job, k, buf);
+        pthread_mutex_lock(&tree_lock);
+        job->failed |= failed;
+        if (++job->done == job->count) {pthread_cond_broadcast(&tree_done);} 
+    }
+    return NULL;
+}
+
+void startHashPool() {
+    pthread_t thread;
+    sigset_t mask, old;
+    int k;
+    if (hash_threads == 0 && (hash_threads = sysconf(_SC_NPROCESSORS_ONLN)) < 1) {hash_threads = 1;} 
+    //hash threads block SIGUSR1, so it interrupts an event loop that can print the counters
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &mask, &old);
+    //TCP workers hash nothing themselves, so every one of the threads is started
+    for (k = 0; k < hash_threads; ++k) {
+        if ((errno = pthread_create(&thread, NULL, hashWorker, NULL))) {
+            fprintf(stderr, "fail to start hash thread %d: %s(errno: %d)\n", k, strerror(errno), errno);
+            exit(1);
+        }
+        pthread_detach(thread);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+//a TCP checksum request is answered by the hash pool, so a long hash does not hold up
+//every other connection of the worker; the connection is left alone until it comes back
+int queueHash(struct Conn* conn) {
+    int type = conn->buff[0] & 0xff;
+    if (type != CHECKSUM_REQ && type != CHECKSUM_AREQ && type != CHECKSUM_TREE_REQ) {return 0;} 
+    conn->state = CONN_HASHING;
+    conn->qnext = NULL;
+    pthread_mutex_lock(&tree_lock);
+    *hash_tail = conn;
+    hash_tail = &conn->qnext;
+    pthread_cond_signal(&tree_work);
+    pthread_mutex_unlock(&tree_lock);
+    return 1;
+}
+
+//send the responses the hash pool has queued
+void finishHashed(struct Worker* worker) {
+    struct Conn* conn;
+    struct Conn* next;
+    eventfd_t n;
+    eventfd_read(worker->event_fd, &n);
+    pthread_mutex_lock(&worker->lock);
+    conn = worker->hashed;
+    worker->hashed = NULL;
+    pthread_mutex_unlock(&worker->lock);
+    for (; conn; conn = next) {
+        next = conn->qnext;
+        conn->state = CONN_WRITE;
+        connProgress(conn);
+    }
+}
+
+// fold n digests pairwise into their root, MD5(left || right) a level at a time; an odd one
+// out goes up unchanged. nodes is overwritten
+void treeRoot(unsigned char* nodes, int n, unsigned char root[]) {
+    int k;
+    for (; n > 1; n = (n + 1) / 2) {
+        for (k = 0; k + 1 < n; k += 2) {
+            EVP_Digest(nodes + 16 * k, 32, nodes + 16 * (k / 2), NULL, EVP_md5(), NULL);
+        }
+        if (n & 1) {memmove(nodes + 16 * (n / 2), nodes + 16 * (n - 1), 16);} 
+    }
+    memcpy(root, nodes, 16);
+}
+
+// split the range into chunks of *chunk bytes (doubled while there would be more than
+// TREE_LEAVES_MAX), hash them in parallel and fold them into root; *leaves gets the chunk
+// digests, to be freed by the caller
+int treeChecksum(const char* file, int offset, int length, int* chunk, int* count, unsigned char** leaves, unsigned char root[]) {
+    char buf[CHUNK_SIZE];
+    struct TreeJob job;
+    struct TreeJob** pp;
+    int k, failed;
+    //an empty range has no chunks to queue and no root
+    if (0 == length) {return 1;} 
+    if (NULL == (job.entry = cacheGet(file))) {
+        return 1;
+    }
+    if (offset >= job.entry->size || (length >= 0 && (off_t) offset + length > job.entry->size)) {
+        fprintf(stderr, "Error: offset+length is larger than the size of the file\n");
+        cacheRelease(job.entry);
+        return 1;
+    }
+    job.offset = offset;
+    job.length = length < 0 ? job.entry->size - offset : length;
+    job.chunk = *chunk;
+    while ((job.length + job.chunk - 1) / job.chunk > TREE_LEAVES_MAX) {
+        job.chunk <<= 1;
+    }
+    job.count = (job.length + job.chunk - 1) / job.chunk;
+    job.next = 0;
+    job.done = 0;
+    job.failed = 0;
+    //the second half is scratch space for the root
+    if (NULL == (job.leaves = (unsigned char* ) malloc(32 * job.count))) {
+        cacheRelease(job.entry);
+        return 1;
+    }
+    pthread_mutex_lock(&tree_lock);
+    for (pp = &tree_queue; *pp; pp = &(*pp)->qnext);
+    *pp = &job;
+    job.qnext = NULL;
+    pthread_cond_broadcast(&tree_work);
+    //hash chunks alongside the pool until none is left, then wait for the ones it took
+    while (job.next < job.count) {
+        k = job.next++;
+        if (job.next == job.count) {
+            for (pp = &tree_queue; *pp != &job; pp = &(*pp)->qnext);
+            *pp = job.qnext;
+        }
+        pthread_mutex_unlock(&tree_lock);
+        failed = treeChunk(&job, k, buf);
+        pthread_mutex_lock(&tree_lock);
+        job.failed |= failed;
+        ++job.done;
+    }
+    while (job.done < job.count) {
+        pthread_cond_wait(&tree_done, &tree_lock);
+    }
+    pthread_mutex_unlock(&tree_lock);
+    cacheRelease(job.entry);
+    if (job.failed) {
+        free(job.leaves);
+        return 1;
+    }
+    memcpy(job.leaves + 16 * job.count, job.leaves, 16 * job.count);
+    treeRoot(job.leaves + 16 * job.count, job.count, root);
+    *chunk = job.chunk;
+    *count = job.count;
+    *leaves = job.leaves;
+    return 0;
+}
+
+struct CacheEntry* download(const char* file, int offset, int* length) {
+    struct CacheEntry* entry;
+
+    if (offset < 0 || 0 == *length) {return NULL;} 
+    if (NULL == (entry = cacheGet(file))) {
+        return NULL;
+    }
+    if (offset >= entry->size || (*length > 0 && (off_t) offset + *length > entry->size)) {
+        cacheRelease(entry);
+        return NULL;
+    }
+    if (*length <= 0) { 
+		*length = entry->size - offset;
+    }
+    return entry;
+}
+
+// send n packets to the session peer with as few sendmmsg() calls as possible;
+// packets the kernel refuses are left for the retransmission timer
+void sendPackets(struct Conn* conn, struct Data_Packet** list, int n, const char* what) {
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iovs[UDP_BATCH];
+    long long now;
+    int k, m, sent;
+    if (netem.on) {
+        now = nowUs();
+        for (k = 0; k < n; ++k) {
+            netemSend(conn, list[k]->data, list[k]->length, now);
+            if (debug_mode) {
+                printf("%s: packet seq=%d, length=%d\n", what, ntohl(readInt32(list[k]->data)), list[k]->length);
+            }
+        }
+        netemFlush(now);
+        return;
+    }
+    while (n > 0) {
+        m = n > UDP_BATCH ? UDP_BATCH : n;
+        memset(msgs, 0, m * sizeof(struct mmsghdr));
+        for (k = 0; k < m; ++k) {
+            iovs[k].iov_base = list[k]->data;
+            iovs[k].iov_len = list[k]->length;
+            msgs[k].msg_hdr.msg_name = &conn->peer;
+            msgs[k].msg_hdr.msg_namelen = sizeof(conn->peer);
+            msgs[k].msg_hdr.msg_iov = &iovs[k];
+            msgs[k].msg_hdr.msg_iovlen = 1;
+        }
+        if ((sent = sendmmsg(socket_fd, msgs, m, 0)) < 1) {
+            if (errno == EINTR) {continue;} 
+            if (debug_mode) {
+                printf("%s failed: %s\n", what, strerror(errno));
+            }
+            return;
+        }
+        for (k = 0; debug_mode && k < sent; ++k) {
+            printf("%s: packet seq=%d, length=%d\n", what, ntohl(readInt32(list[k]->data)), list[k]->length);
+        }
+        list += sent;
+        n -= sent;
+    }
+}
+
+void sendPacket(struct Conn* conn, struct Data_Packet* packet, const char* what) {
+    sendPackets(conn, &packet, 1, what);
+}
+
+uint32_t crc32cSoft(uint32_t crc, const char* buf, size_t len) {
+    for (; len > 0; --len) {
+        crc = crc32c_table[(crc ^ (unsigned char) *buf++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+// the SSE4.2 crc32 instruction, 8 bytes at a time
+__attribute__((target("sse4.2"))) uint32_t crc32cHard(uint32_t crc, const char* buf, size_t len) {
+    uint64_t c = crc, v;
+    for (; len >= 8; len -= 8, buf += 8) {
+        memcpy(&v, buf, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    for (; len > 0; --len) {
+        c = _mm_crc32_u8((uint32_t) c, *buf++);
+    }
+    return (uint32_t) c;
+}
+#else
+uint32_t crc32cHard(uint32_t crc, const char* buf, size_t len) {
+    return crc32cSoft(crc, buf, len);
+}
+#endif
+
+// build the table of the portable CRC32C and use the crc32 instruction when the CPU has it
+void crc32cInit() {
+    uint32_t c;
+    int k, b;
+    for (k = 0; k < 256; ++k) {
+        for (c = k, b = 0; b < 8; ++b) {
+            c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        }
+        crc32c_table[k] = c;
+    }
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {crc32cUpdate = crc32cHard;} 
+#endif
+}
+
+// append the CRC32C of the packet so far, the client drops and NAKs a packet that fails it
+void crcSeal(struct Data_Packet* packet) {
+    writeInt32(packet->data + packet->length, htonl(~crc32cUpdate(~0u, packet->data, packet->length)));
+    packet->length += CRC_SIZE;
+}
+
+// splitmix64 in [0, 1); the same seed draws the same impairments for the same packets
+double netemRandom() {
+    uint64_t z = (netem_rng += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return ((z ^ (z >> 31)) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// a delay drawn from the -netem distribution, us, never negative
+long long netemDelay() {
+    double x;
+    if (netem.dist == NETEM_NORMAL) {
+        x = sqrt(-2 * log(1 - netemRandom())) * cos(2 * M_PI * netemRandom());
+    } else if (netem.dist == NETEM_PARETO) {
+        x = pow(1 - netemRandom(), -1 / NETEM_PARETO_ALPHA) - 1;
+    } else {
+        x = 2 * netemRandom() - 1;
+    }
+    x = netem.delay + netem.jitter * x;
+    return x > 0 ? (long long) x : 0;
+}
+
+// spec is a comma separated list of key=value: delay=ms, jitter=ms, dist=uniform|normal|pareto,
+// reorder=%, dup=%, corrupt=%, rate=mbps, queue=packets, ge=p%:r%[:bad loss%[:good loss%]], seed=n
+int parseNetem(const char* spec) {
+    char buf[256];
+    char *item, *val, *save;
+    double p, r, bad = 100, good = 0;
+    if (strlen(spec) >= sizeof(buf)) {return -1;} 
+    strcpy(buf, spec);
+    for (item = strtok_r(buf, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        if (NULL == (val = strchr(item, '='))) {return -1;} 
+        *val++ = '\0';
+        if (0 == strcmp("delay", item)) {
+            if ((netem.delay = atof(val) * 1000) < 0) {return -1;} 
+        } else if (0 == strcmp("jitter", item)) {
+            if ((netem.jitter = atof(val) * 1000) < 0) {return -1;} 
+        } else if (0 == strcmp("dist", item)) {
+            if (0 == strcmp("uniform", val)) {
+                netem.dist = NETEM_UNIFORM;
+            } else if (0 == strcmp("normal", val)) {
+                netem.dist = NETEM_NORMAL;
+            } else if (0 == strcmp("pareto", val)) {
+                netem.dist = NETEM_PARETO;
+            } else {
+                return -1;
+            }
+        } else if (0 == strcmp("reorder", item)) {
+            if ((netem.reorder = atof(val) / 100) < 0 || netem.reorder > 1) {return -1;} 
+        } else if (0 == strcmp("dup", item)) {
+            if ((netem.dup = atof(val) / 100) < 0 || netem.dup > 1) {return -1;} 
+        } else if (0 == strcmp("corrupt", item)) {
+            if ((netem.corrupt = atof(val) / 100) < 0 || netem.corrupt > 1) {return -1;} 
+        } else if (0 == strcmp("rate", item)) {
+            //Mbit/s to bytes/us
+            if ((netem.rate = atof(val) / 8) <= 0) {return -1;} 
+        } else if (0 == strcmp("queue", item)) {
+            if ((netem.queue = atoi(val)) < 1) {return -1;} 
+        } else if (0 == strcmp("ge", item)) {
+            if (sscanf(val, "%lf:%lf:%lf:%lf", &p, &r, &bad, &good) < 2 || p <= 0 || p > 100 || r < 0 || r > 100
+                || bad < 0 || bad > 100 || good < 0 || good > 100) {
+                return -1;
+            }
+            netem.ge_p = p / 100;
+            netem.ge_r = r / 100;
+            netem.ge_bad = bad / 100;
+            netem.ge_good = good / 100;
+        } else if (0 == strcmp("seed", item)) {
+            netem_rng = strtoull(val, NULL, 10);
+        } else {
+            return -1;
+        }
+    }
+    netem.on = 1;
+    return 0;
+}
+
+// pass a datagram through the impairments of the session's path: Gilbert-Elliott loss,
+// duplication, corruption, the bottleneck queue (tail drop) and the delay; copies of what survives
+// wait in the delay heap
+void netemSend(struct Conn* conn, const char* data, int length, long long now) {
+    struct Delayed* d;
+    double start;
+    int copies = 1;
+    if (netem.ge_p > 0) {
+        conn->ge_state = conn->ge_state ? netemRandom() >= netem.ge_r : netemRandom() < netem.ge_p;
+        if (netemRandom() < (conn->ge_state ? netem.ge_bad : netem.ge_good)) {
+            if (debug_mode) {
+                printf("netem loss: packet seq=%d\n", ntohl(readInt32(data)));
+            }
+            return;
+        }
+    }
+    if (netem.dup > 0 && netemRandom() < netem.dup) {copies = 2;} 
+    while (copies-- > 0) {
+        start = now;
+        if (netem.rate > 0) {
+            if (conn->link_free < now) {conn->link_free = now;} 
+            if ((conn->link_free - now) * netem.rate + length > (double) netem.queue * conn->datagram) {
+                if (debug_mode) {
+                    printf("netem queue full: packet seq=%d\n", ntohl(readInt32(data)));
+                }
+                continue;
+            }
+            conn->link_free += length / netem.rate;
+            start = conn->link_free;
+        }
+        if (NULL == (d = (struct Delayed* ) malloc(sizeof(struct Delayed) + length))) {continue;} 
+        d->due = (long long) start + (netem.reorder > 0 && netemRandom() < netem.reorder ? 0 : netemDelay());
+        d->order = delay_order++;
+        d->peer = conn->peer;
+        d->length = length;
+        memcpy(d->data, data, length);
+        if (netem.corrupt > 0 && netemRandom() < netem.corrupt) {
+            d->data[(int) (netemRandom() * length)] ^= 1 << (int) (netemRandom() * 8);
+        }
+        if (delayPush(d)) {free(d);} 
+    }
+}
+
+int delayBefore(int a, int b) {
+    return delay_heap[a]->due < delay_heap[b]->due
+        || (delay_heap[a]->due == delay_heap[b]->due && delay_heap[a]->order < delay_heap[b]->order);
+}
+
+int delayPush(struct Delayed* d) {
+    struct Delayed** heap;
+    struct Delayed* tmp;
+    int k, parent;
+    if (delay_count == delay_cap) {
+        k = delay_cap ? 2 * delay_cap : DELAY_HEAP_INIT;
+        if (NULL == (heap = (struct Delayed** ) realloc(delay_heap, k * sizeof(struct Delayed*)))) {return -1;} 
+        delay_heap = heap;
+        delay_cap = k;
+    }
+    delay_heap[k = delay_count++] = d;
+    while (k > 0 && delayBefore(k, parent = (k - 1) / 2)) {
+        tmp = delay_heap[k];
+        delay_heap[k] = delay_heap[parent];
+        delay_heap[parent] = tmp;
+        k = parent;
+    }
+    return 0;
+}
+
+struct Delayed* delayPop() {
+    struct Delayed* d = delay_heap[0];
+    struct Delayed* tmp;
+    int k = 0, child;
+    delay_heap[0] = delay_heap[--delay_count];
+    while ((child = 2 * k + 1) < delay_count) {
+        if (child + 1 < delay_count && delayBefore(child + 1, child)) {++child;} 
+        if (!delayBefore(child, k)) {break;} 
+        tmp = delay_heap[k];
+        delay_heap[k] = delay_heap[child];
+        delay_heap[child] = tmp;
+        k = child;
+    }
+    return d;
+}
+
+// us until the earliest delayed datagram is due, -1 if none is held
+long long netemTimeout(long long now) {
+    if (delay_count == 0) {return -1;} 
+    return delay_heap[0]->due <= now ? 0 : delay_heap[0]->due - now;
+}
+
+// hand every due datagram to the socket, UDP_BATCH per sendmmsg()
+void netemFlush(long long now) {
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iovs[UDP_BATCH];
+    struct Delayed* batch[UDP_BATCH];
+    int k, m, sent;
+    while (delay_count > 0 && delay_heap[0]->due <= now) {
+        memset(msgs, 0, sizeof(msgs));
+        for (m = 0; m < UDP_BATCH && delay_count > 0 && delay_heap[0]->due <= now; ++m) {
+            batch[m] = delayPop();
+            iovs[m].iov_base = batch[m]->data;
+            iovs[m].iov_len = batch[m]->length;
+            msgs[m].msg_hdr.msg_name = &batch[m]->peer;
+            msgs[m].msg_hdr.msg_namelen = sizeof(batch[m]->peer);
+            msgs[m].msg_hdr.msg_iov = &iovs[m];
+            msgs[m].msg_hdr.msg_iovlen = 1;
+        }
+        for (k = 0; k < m; k += sent) {
+            if ((sent = sendmmsg(socket_fd, msgs + k, m - k, 0)) < 1) {
+                if (errno == EINTR) {
+                    sent = 0;
+                    continue;
+                }
+                if (debug_mode) {
+                    printf("netem send failed: %s\n", strerror(errno));
+                }
+                break;
+            }
+        }
+        for (k = 0; k < m; ++k) {
+            free(batch[k]);
+        }
+    }
+}
+
+// a packet with room for a datagram of size bytes; pooled buffers grow to the largest size asked
+struct Data_Packet* packetAlloc(int size) {
+    struct Data_Packet* packet = packet_pool;
+    char* data;
+    if (packet) {
+        if (packet->size < size) {
+            if (NULL == (data = (char*) realloc(packet->data, size))) {return NULL;} 
+            packet->data = data;
+            packet->size = size;
+        }
+        packet_pool = packet->next;
+        --packet_pool_size;
+        return packet;
+    }
+    if (NULL == (packet = (struct Data_Packet* ) malloc(sizeof(struct Data_Packet)))) {return NULL;} 
+    if (NULL == (packet->data = (char*) malloc(size))) {
+        free(packet);
+        return NULL;
+    }
+    packet->size = size;
+    packet->heap_idx = -1;
+    return packet;
+}
+
+void packetFree(struct Data_Packet* packet) {
+    if (packet_pool_size >= PACKET_POOL_MAX) {
+        free(packet->data);
+        free(packet);
+        return;
+    }
+    packet->next = packet_pool;
+    packet_pool = packet;
+    ++packet_pool_size;
+}
+
+// make room in the window ring for packet_seq, doubling the ring up to the client's window
+int windowReserve(struct Conn* conn) {
+    struct Data_Packet** window;
+    int seq, cap = conn->window_cap;
+    if (conn->packet_seq - conn->snd_una >= conn->rwnd) {return -1;} 
+    if (conn->packet_seq - conn->snd_una < cap) {return 0;} 
+    if (NULL == (window = (struct Data_Packet** ) calloc(2 * cap, sizeof(struct Data_Packet*)))) {return -1;} 
+    for (seq = conn->snd_una; seq < conn->packet_seq; ++seq) {
+        window[seq % (2 * cap)] = conn->window[seq % cap];
+    }
+    free(conn->window);
+    conn->window = window;
+    conn->window_cap = 2 * cap;
+    return 0;
+}
+
+// the original behaviour: the window stays at -w
+void fixedInit(struct Conn* conn) {
+    conn->cwnd = window_size;
+    conn->ssthresh = window_size;
+}
+
+void fixedAck(struct Conn* conn, long long rtt, long long now) {
+}
+
+void fixedLoss(struct Conn* conn, long long now) {
+}
+
+// AIMD: slow start up to ssthresh, then one packet per window; halve on a loss
+void renoInit(struct Conn* conn) {
+    conn->cwnd = window_size;
+    conn->ssthresh = CWND_MAX;
+}
+
+void renoAck(struct Conn* conn, long long rtt, long long now) {
+    if (conn->cwnd < conn->ssthresh) {
+        conn->cwnd += 1;
+    } else {
+        conn->cwnd += 1 / conn->cwnd;
+    }
+}
+
+void renoLoss(struct Conn* conn, long long now) {
+    conn->ssthresh = conn->cwnd / 2 < 2 ? 2 : conn->cwnd / 2;
+    conn->cwnd = conn->ssthresh;
+}
+
+// CUBIC (RFC 8312): after a loss the window follows C*(t-K)^3 + w_max, never slower than Reno
+void cubicInit(struct Conn* conn) {
+    renoInit(conn);
+    conn->w_max = 0;
+    conn->epoch = 0;
+}
+
+void cubicAck(struct Conn* conn, long long rtt, long long now) {
+    double t, target;
+    if (conn->cwnd < conn->ssthresh) {
+        conn->cwnd += 1;
+        return;
+    }
+    if (conn->epoch == 0) {
+        conn->epoch = now;
+        if (conn->cwnd < conn->w_max) {
+            conn->cubic_k = cbrt((conn->w_max - conn->cwnd) / CUBIC_C);
+            conn->w_origin = conn->w_max;
+        } else {
+            conn->cubic_k = 0;
+            conn->w_origin = conn->cwnd;
+        }
+        conn->w_est = conn->cwnd;
+    }
+    t = (now - conn->epoch + conn->srtt) / 1e6;
+    target = CUBIC_C * (t - conn->cubic_k) * (t - conn->cubic_k) * (t - conn->cubic_k) + conn->w_origin;
+    conn->w_est += 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) / conn->cwnd;
+    if (target < conn->w_est) {target = conn->w_est;} 
+    if (target > conn->cwnd) {
+        conn->cwnd += (target - conn->cwnd) / conn->cwnd;
+    } else {
+        conn->cwnd += 0.01 / conn->cwnd;
+    }
+}
+
+void cubicLoss(struct Conn* conn, long long now) {
+    conn->epoch = 0;
+    conn->w_max = conn->cwnd;
+    conn->cwnd = conn->cwnd * CUBIC_BETA < 2 ? 2 : conn->cwnd * CUBIC_BETA;
+    conn->ssthresh = conn->cwnd;
+}
+
+// BBR-like: the window is a gain times the bandwidth-delay product measured from the
+// max delivery rate over the last round trips and the min RTT; losses are ignored
+void bbrInit(struct Conn* conn) {
+    conn->cwnd = window_size;
+    conn->ssthresh = CWND_MAX;
+    conn->delivered = 0;
+    conn->round_delivered = 0;
+    conn->round_seq = INITIAL_SEQ;
+    conn->round_start = nowUs();
+    conn->rounds = 0;
+    memset(conn->bw, 0, sizeof(conn->bw));
+    conn->btl_bw = 0;
+    conn->full_bw = 0;
+    conn->full_bw_count = 0;
+    conn->startup = 1;
+    conn->min_rtt = 0;
+    conn->min_rtt_stamp = 0;
+}
+
+void bbrAck(struct Conn* conn, long long rtt, long long now) {
+    int k;
+    ++conn->delivered;
+    if (rtt >= 0 && (conn->min_rtt == 0 || rtt <= conn->min_rtt || now - conn->min_rtt_stamp > BBR_RTT_WINDOW)) {
+        conn->min_rtt = rtt > 0 ? rtt : 1;
+        conn->min_rtt_stamp = now;
+    }
+    //a round trip ends when a packet sent after the round began is acked
+    if (conn->snd_una > conn->round_seq && now > conn->round_start) {
+        conn->bw[conn->rounds++ % BBR_BW_ROUNDS] = (double) (conn->delivered - conn->round_delivered) / (now - conn->round_start);
+        conn->btl_bw = 0;
+        for (k = 0; k < BBR_BW_ROUNDS; ++k) {
+            if (conn->bw[k] > conn->btl_bw) {conn->btl_bw = conn->bw[k];} 
+        }
+        if (conn->startup) {
+            if (conn->btl_bw >= conn->full_bw * 1.25) {
+                conn->full_bw = conn->btl_bw;
+                conn->full_bw_count = 0;
+            } else if (++conn->full_bw_count >= 3) {
+                conn->startup = 0;
+            }
+        }
+        conn->round_seq = conn->packet_seq;
+        conn->round_start = now;
+        conn->round_delivered = conn->delivered;
+    }
+    if (conn->btl_bw == 0 || conn->min_rtt == 0) {
+        conn->cwnd += 1;
+        return;
+    }
+    conn->cwnd = (conn->startup ? BBR_STARTUP_GAIN : BBR_CWND_GAIN) * conn->btl_bw * conn->min_rtt;
+    if (conn->cwnd < 4) {conn->cwnd = 4;} 
+}
+
+void bbrLoss(struct Conn* conn, long long now) {
+}
+
+void ccClamp(struct Conn* conn) {
+    if (conn->cwnd < 1) {conn->cwnd = 1;} 
+    if (conn->cwnd > conn->rwnd) {conn->cwnd = conn->rwnd;} 
+}
+
+// every timeout of a packet sent after the previous loss event starts a new loss event
+void ccLoss(struct Conn* conn, int seq, long long now) {
+    if (seq < conn->recover_seq) {return;} 
+    conn->recover_seq = conn->packet_seq;
+    cc->loss(conn, now);
+    ccClamp(conn);
+    traceCwnd(conn, now);
+}
+
+// one line whenever the whole-packet window or ssthresh changes
+void traceCwnd(struct Conn* conn, long long now) {
+    if (NULL == pf_cctrace) {return;} 
+    if ((int) conn->cwnd == (int) conn->traced_cwnd && conn->ssthresh == conn->traced_ssthresh) {return;} 
+    conn->traced_cwnd = conn->cwnd;
+    conn->traced_ssthresh = conn->ssthresh;
+    fprintf(pf_cctrace, "%lld %s:%d %.2f %.2f %d %lld\n", now, inet_ntoa(conn->peer.sin_addr),
+        ntohs(conn->peer.sin_port), conn->cwnd, conn->ssthresh, conn->inflight, conn->srtt);
+}
+
+void timerSwap(int a, int b) {
+    struct Data_Packet* tmp = timer_heap[a];
+    timer_heap[a] = timer_heap[b];
+    timer_heap[b] = tmp;
+    timer_heap[a]->heap_idx = a;
+    timer_heap[b]->heap_idx = b;
+}
+
+void timerUp(int k) {
+    while (k > 0 && timer_heap[(k - 1) / 2]->deadline > timer_heap[k]->deadline) {
+        timerSwap(k, (k - 1) / 2);
+        k = (k - 1) / 2;
+    }
+}
+
+void timerDown(int k) {
+    int child;
+    while ((child = 2 * k + 1) < timer_count) {
+        if (child + 1 < timer_count && timer_heap[child + 1]->deadline < timer_heap[child]->deadline) {++child;} 
+        if (timer_heap[k]->deadline <= timer_heap[child]->deadline) {break;} 
+        timerSwap(k, child);
+        k = child;
+    }
+}
+
+// arm the retransmission timer of a packet at packet->deadline
+int timerPush(struct Data_Packet* packet) {
+    struct Data_Packet** heap;
+    if (timer_count == timer_cap) {
+        heap = (struct Data_Packet** ) realloc(timer_heap, (timer_cap ? 2 * timer_cap : TIMER_HEAP_INIT) * sizeof(struct Data_Packet*));
+        if (NULL == heap) {return -1;} 
+        timer_heap = heap;
+        timer_cap = timer_cap ? 2 * timer_cap : TIMER_HEAP_INIT;
+    }
+    packet->heap_idx = timer_count;
+    timer_heap[timer_count++] = packet;
+    timerUp(packet->heap_idx);
+    return 0;
+}
+
+void timerRemove(struct Data_Packet* packet) {
+    int k = packet->heap_idx;
+    if (k < 0) {return;} 
+    packet->heap_idx = -1;
+    if (k != --timer_count) {
+        timer_heap[k] = timer_heap[timer_count];
+        timer_heap[k]->heap_idx = k;
+        timerUp(k);
+        timerDown(k);
+    }
+}
+
+// us until the earliest retransmission deadline, -1 if no timer is armed
+long long timerTimeout(long long now) {
+    if (timer_count == 0) {return -1;} 
+    return timer_heap[0]->deadline <= now ? 0 : timer_heap[0]->deadline - now;
+}
+
+void markReady(struct Conn* conn) {
+    if (conn->ready) {return;} 
+    conn->ready = 1;
+    conn->next = ready_sessions;
+    ready_sessions = conn;
+}
+
+// refill a token bucket at rate bytes/us, up to BUCKET_DEPTH us of tokens but at least a datagram
+double bucketFill(double tokens, long long* stamp, double rate, int datagram, long long now) {
+    double depth = rate * BUCKET_DEPTH > datagram ? rate * BUCKET_DEPTH : datagram;
+    tokens += (now - *stamp) * rate;
+    *stamp = now;
+    return tokens > depth ? depth : tokens;
+}
+
+// us time a bucket short of a datagram holds BUCKET_QUANTUM us of tokens (or a datagram), now if
+// it holds a datagram already
+long long bucketTime(double tokens, double rate, int datagram, long long now) {
+    double want = rate * BUCKET_QUANTUM > datagram ? rate * BUCKET_QUANTUM : datagram;
+    return tokens >= datagram ? now : now + (long long) ((want - tokens) / rate) + 1;
+}
+
+// us time the session may send its next datagram: when its pacing gap, less one quantum,
+// has passed and both token buckets hold a datagram
+long long paceTime(struct Conn* conn, long long now) {
+    long long t, at = now;
+    if (pacing && conn->pace_next > now + PACE_QUANTUM) {at = (long long) conn->pace_next - PACE_QUANTUM;} 
+    if (session_rate > 0) {
+        conn->tokens = bucketFill(conn->tokens, &conn->tokens_stamp, session_rate, conn->datagram, now);
+        if ((t = bucketTime(conn->tokens, session_rate, conn->datagram, now)) > at) {at = t;} 
+    }
+    if (total_rate > 0) {
+        total_tokens = bucketFill(total_tokens, &total_stamp, total_rate, conn->datagram, now);
+        if ((t = bucketTime(total_tokens, total_rate, conn->datagram, now)) > at) {at = t;} 
+    }
+    return at;
+}
+
+// charge a datagram of length bytes, resent or not, to the pacing clock and the token buckets;
+// the pacing rate is a gain times cwnd/srtt, unpaced until the first RTT sample
+void paceSent(struct Conn* conn, int length, long long now) {
+    if (pacing && conn->srtt > 0) {
+        if (conn->pace_next < now) {conn->pace_next = now;} 
+        conn->pace_next += (double) length * conn->srtt
+            / ((conn->cwnd < conn->ssthresh ? PACE_SS_GAIN : PACE_CA_GAIN) * conn->cwnd * conn->datagram);
+    }
+    if (session_rate > 0) {conn->tokens -= length;} 
+    if (total_rate > 0) {total_tokens -= length;} 
+}
+
+// serve the session again at us time at
+void paceHold(struct Conn* conn, long long at) {
+    if (conn->pace_at == 0) {
+        conn->pnext = paced_sessions;
+        paced_sessions = conn;
+    }
+    conn->pace_at = at;
+}
+
+void paceRelease(struct Conn* conn) {
+    struct Conn** pp;
+    if (conn->pace_at == 0) {return;} 
+    for (pp = &paced_sessions; *pp; pp = &(*pp)->pnext) {
+        if (*pp == conn) {
+            *pp = conn->pnext;
+            break;
+        }
+    }
+    conn->pace_at = 0;
+}
+
+// us until the earliest held back session may send, -1 if none is held
+long long paceTimeout(long long now) {
+    struct Conn* conn;
+    long long at = -1;
+    for (conn = paced_sessions; conn; conn = conn->pnext) {
+        if (at < 0 || conn->pace_at < at) {at = conn->pace_at;} 
+    }
+    return at < 0 ? -1 : at <= now ? 0 : at - now;
+}
+
+// move the held back sessions whose time has come to the ready list
+void paceWake(long long now) {
+    struct Conn** pp = &paced_sessions;
+    struct Conn* conn;
+    while ((conn = *pp)) {
+        if (conn->pace_at > now) {
+            pp = &conn->pnext;
+            continue;
+        }
+        *pp = conn->pnext;
+        conn->pace_at = 0;
+        markReady(conn);
+    }
+}
+
+// Jacobson/Karels estimator (RFC 6298)
+void rttSample(struct Conn* conn, long long rtt) {
+    long long err;
+    if (conn->srtt == 0) {
+        conn->srtt = rtt > 0 ? rtt : 1;
+        conn->rttvar = rtt / 2;
+    } else {
+        err = conn->srtt > rtt ? conn->srtt - rtt : rtt - conn->srtt;
+        conn->rttvar += (err - conn->rttvar) / 4;
+        conn->srtt += (rtt - conn->srtt) / 8;
+        if (conn->srtt < 1) {conn->srtt = 1;} 
+    }
+    conn->rto = conn->srtt + (4 * conn->rttvar > RTO_GRANULARITY ? 4 * conn->rttvar : RTO_GRANULARITY);
+    if (conn->rto < RTO_MIN) {conn->rto = RTO_MIN;} 
+    if (conn->rto > RTO_MAX) {conn->rto = RTO_MAX;} 
+    if (conn->rtt_samples++ == 0 || rtt < conn->rtt_min) {conn->rtt_min = rtt;} 
+    if (rtt > conn->rtt_max) {conn->rtt_max = rtt;} 
+}
+
+void printRttStats(struct Conn* conn) {
+    printf("rtt stats: peer %s:%d, samples=%ld, min=%.3fms, max=%.3fms, srtt=%.3fms, rttvar=%.3fms, rto=%.3fms, timeouts=%ld, fast retransmits=%ld, nak retransmits=%ld, %s cwnd=%.1f, ssthresh=%.1f\n",
+        inet_ntoa(conn->peer.sin_addr), ntohs(conn->peer.sin_port), conn->rtt_samples,
+        conn->rtt_min / 1000.0, conn->rtt_max / 1000.0, conn->srtt / 1000.0, conn->rttvar / 1000.0,
+        conn->rto / 1000.0, conn->timeouts, conn->fast_retransmits, conn->nak_resends, cc->name, conn->cwnd, conn->ssthresh);
+}
+
+// release one acked packet; rtt is set from the most recently sent packet that was never resent
+// (Karn's rule: the ACK of a resent packet is ambiguous) and newest to the latest transmission
+// acked; return 1 if the packet was in flight
+int ackPacket(struct Conn* conn, int seq, long long now, long long* rtt, long long* newest) {
+    struct Data_Packet* packet;
+    if (seq < conn->snd_una || seq >= conn->packet_seq) {return 0;} 
+    if (NULL == (packet = conn->window[seq % conn->window_cap])) {return 0;} //acked before
+    if (debug_mode) {
+        printf("recv ack: packet seq=%d, length=%d\n", seq, packet->length);
+    }
+    if (packet->retries == 0 && (*rtt < 0 || now - packet->sent < *rtt)) {
+        *rtt = now - packet->sent;
+    }
+    if (packet->sent > *newest) {*newest = packet->sent;} 
+    timerRemove(packet);
+    conn->window[seq % conn->window_cap] = NULL;
+    packetFree(packet);
+    --conn->inflight;
+    return 1;
+}
+
+// an 8-byte ACK acknowledges the one packet it echoes; a SACK ACK acknowledges every packet
+// before its cumulative seq and each packet cum+1+32*w+i whose bit i of bitmap word w is set
+void recvAck(struct Conn* conn, const char* ack, int length) {
+    long long now = nowUs(), rtt = -1, newest = 0;
+    unsigned int bitmap;
+    int k, w, seq, high, acked = 0;
+    seq = ntohl(readInt32(ack));
+    high = seq;
+    if (ntohl(readInt32(ack + 4)) & ACK_FLAG_NAK) {
+        nakPacket(conn, seq, now);
+        return;
+    }
+    if (length >= ACK_SACK_SIZE && (ntohl(readInt32(ack + 4)) & ACK_FLAG_SACK)) {
+        for (k = conn->snd_una; k < seq && k < conn->packet_seq; ++k) {
+            acked += ackPacket(conn, k, now, &rtt, &newest);
+        }
+        for (w = 0; 8 + 4 * w + 4 <= length; ++w) {
+            bitmap = ntohl(readInt32(ack + 8 + 4 * w));
+            for (k = 0; bitmap && k < 32; ++k) {
+                if (bitmap & (1u << k) && ackPacket(conn, seq + 1 + 32 * w + k, now, &rtt, &newest)) {
+                    ++acked;
+                    high = seq + 1 + 32 * w + k;
+                }
+            }
+        }
+    } else {
+        acked = ackPacket(conn, seq, now, &rtt, &newest);
+    }
+    if (acked == 0) {return;} 
+    if (rtt >= 0) {rttSample(conn, rtt);} 
+    while (conn->snd_una < conn->packet_seq && NULL == conn->window[conn->snd_una % conn->window_cap]) {
+        ++conn->snd_una;
+    }
+    while (acked-- > 0) {
+        cc->ack(conn, rtt, now);
+    }
+    ccClamp(conn);
+    fastRetransmit(conn, high, newest, now);
+    traceCwnd(conn, now);
+    markReady(conn);
+}
+
+// a packet below high still missing after DUPTHRESH ACKs of packets sent after it is lost:
+// resend it at once instead of at its timeout, a loss event for the congestion control
+// but no RTO backoff
+void fastRetransmit(struct Conn* conn, int high, long long newest, long long now) {
+    struct Data_Packet* packet;
+    int seq;
+    for (seq = conn->snd_una; seq < high; ++seq) {
+        packet = conn->window[seq % conn->window_cap];
+        if (NULL == packet || packet->sent >= newest || ++packet->dupacks < DUPTHRESH) {continue;} 
+        if (++packet->retries > SESSION_MAX_RETRIES) {
+            conn->failed = 1;
+            return;
+        }
+        ++conn->fast_retransmits;
+        ccLoss(conn, seq, now);
+        timerRemove(packet);
+        sendPacket(conn, packet, "fast retransmission");
+        paceSent(conn, packet->length, now);
+        packet->sent = now;
+        packet->dupacks = 0;
+        packet->rto = conn->rto;
+        packet->deadline = now + packet->rto;
+        timerPush(packet);
+    }
+}
+
+// a corrupted packet is no sign of congestion: resend it at once, without a loss event or backoff
+void nakPacket(struct Conn* conn, int seq, long long now) {
+    struct Data_Packet* packet;
+    if (seq < conn->snd_una || seq >= conn->packet_seq || NULL == (packet = conn->window[seq % conn->window_cap])) {return;} 
+    if (++packet->retries > SESSION_MAX_RETRIES) {
+        conn->failed = 1;
+        markReady(conn);
+        return;
+    }
+    ++conn->nak_resends;
+    timerRemove(packet);
+    sendPacket(conn, packet, "nak retransmission");
+    paceSent(conn, packet->length, now);
+    packet->sent = now;
+    packet->dupacks = 0;
+    packet->deadline = now + packet->rto;
+    timerPush(packet);
+}
+
+// resend exactly the packets whose timers have expired; every timeout doubles the session RTO
+// relative to the timeout that expired, so a window of packets sent together backs off once,
+// but never from a timeout armed before RTT samples lowered the estimate
+void retransmission(long long now) {
+    struct Data_Packet* packet;
+    struct Conn* conn;
+    long long backoff;
+    while (timer_count > 0 && timer_heap[0]->deadline <= now) {
+        packet = timer_heap[0];
+        conn = packet->conn;
+        timerRemove(packet);
+        if (conn->failed) {continue;} 
+        if (++packet->retries > SESSION_MAX_RETRIES) {
+            conn->failed = 1;
+            markReady(conn);
+            continue;
+        }
+        ++conn->timeouts;
+        ccLoss(conn, packet->seq, now);
+        backoff = 2 * (packet->rto < conn->rto ? packet->rto : conn->rto);
+        if (conn->rto < backoff) {conn->rto = backoff > RTO_MAX ? RTO_MAX : backoff;} 
+        sendPacket(conn, packet, "retransmission");
+        paceSent(conn, packet->length, now);
+        packet->sent = now;
+        packet->dupacks = 0;
+        packet->rto = conn->rto;
+        packet->deadline = now + packet->rto;
+        timerPush(packet);
+    }
+}
+
+// copy the next bytes of the response; the head is never packed together with the body
+int nextPayload(struct Conn* conn, char* dst, int max_length) {
+    int n, len = 0;
+    if (conn->out_sent < conn->out_len) {
+        len = conn->out_len - conn->out_sent > max_length ? max_length : conn->out_len - conn->out_sent;
+        memcpy(dst, conn->out + conn->out_sent, len);
+        conn->out_sent += len;
+        return len;
+    }
+    while (len < max_length) {
+        if (conn->chunk_sent == conn->chunk_len) {
+            if (conn->body_left <= 0) {break;} 
+            if (fillChunk(conn)) {return -1;} 
+        }
+        n = conn->chunk_len - conn->chunk_sent > max_length - len ? max_length - len : conn->chunk_len - conn->chunk_sent;
+        memcpy(dst + len, conn->chunk_data + conn->chunk_sent, n);
+        conn->chunk_sent += n;
+        len += n;
+    }
+    return len;
+}
+
+// dst ^= src, a 64-bit word at a time
+void xorBytes(char* dst, const char* src, int n) {
+    uint64_t a, b;
+    int k;
+    for (k = 0; k + 8 <= n; k += 8) {
+        memcpy(&a, dst + k, 8);
+        memcpy(&b, src + k, 8);
+        a ^= b;
+        memcpy(dst + k, &a, 8);
+    }
+    for (; k < n; ++k) {
+        dst[k] ^= src[k];
+    }
+}
+
+// fold the payload of a new data packet into the parity of its group
+void fecAdd(struct Conn* conn, struct Data_Packet* packet) {
+    int len = packet->length - 4 - PACKET_RESERVE_SIZE - (conn->crc ? CRC_SIZE : 0);
+    if (conn->fec_count == 0) {
+        conn->fec_first = packet->seq;
+        conn->fec_len = 0;
+        conn->fec_max = 0;
+        memset(conn->fec_parity->data + 4 + PACKET_RESERVE_SIZE, 0, conn->datagram - 4 - PACKET_RESERVE_SIZE);
+    }
+    xorBytes(conn->fec_parity->data + 4 + PACKET_RESERVE_SIZE, packet->data + 4 + PACKET_RESERVE_SIZE, len);
+    conn->fec_len ^= len;
+    if (len > conn->fec_max) {conn->fec_max = len;} 
+    ++conn->fec_count;
+}
+
+// close the current group: the parity packet carries the seq of the group's first packet and,
+// in its reserved field, PACKET_FLAG_PARITY, the number of packets and the XOR of their lengths;
+// it is sent once and never acked, the caller frees it
+struct Data_Packet* fecParity(struct Conn* conn) {
+    struct Data_Packet* packet = conn->fec_parity;
+    if (NULL == (conn->fec_parity = packetAlloc(conn->datagram))) {
+        conn->fec_parity = packet;
+        conn->fec_count = 0;
+        return NULL;
+    }
+    writeInt32(packet->data, htonl(conn->fec_first));
+    writeInt32(packet->data + 4, htonl((PACKET_FLAG_PARITY | (conn->crc ? PACKET_FLAG_CRC : 0)) << 24
+        | conn->fec_count << 16 | conn->fec_len));
+    packet->length = 4 + PACKET_RESERVE_SIZE + conn->fec_max;
+    if (conn->crc) {crcSeal(packet);} 
+    packet->seq = conn->fec_first;
+    conn->fec_count = 0;
+    return packet;
+}
+
+// every byte of the response has been packed into packets
+int payloadDone(struct Conn* conn) {
+    return conn->out_sent == conn->out_len && conn->chunk_sent == conn->chunk_len && conn->body_left <= 0;
+}
+
+// send new pieces of the response while the congestion window, pacing and the rate limits
+// allow, all at once; return 1 when the whole response is acked, -1 on failure
+int usend(struct Conn* conn) {
+    const int MAX_SEND = conn->datagram - 4 - PACKET_RESERVE_SIZE - (conn->crc ? CRC_SIZE : 0);
+    struct Data_Packet* packet;
+    struct Data_Packet* batch[UDP_BATCH];
+    struct Data_Packet* parity[UDP_BATCH]; // parity packets of batch, freed once sent
+    long long at, now = nowUs();
+    int send, n = 0, np = 0, held = 0;
+    while (conn->inflight < (int) conn->cwnd && 0 == windowReserve(conn)) {
+        if ((at = paceTime(conn, now)) > now) {
+            paceHold(conn, at);
+            held = 1;
+            break;
+        }
+        if (NULL == (packet = packetAlloc(conn->datagram))) {return -1;} 
+        if ((send = nextPayload(conn, packet->data + 4 + PACKET_RESERVE_SIZE, MAX_SEND)) <= 0) {
+            packetFree(packet);
+            if (send < 0) {return -1;} 
+            break;
+        }
+        packet->conn = conn;
+        packet->length = send + 4 + PACKET_RESERVE_SIZE;
+        packet->seq = conn->packet_seq++;
+        writeInt32(packet->data, htonl(packet->seq));
+        writeInt32(packet->data + 4, htonl(conn->crc ? PACKET_FLAG_CRC << 24 : 0));
+        if (conn->crc) {crcSeal(packet);} 
+        packet->retries = 0;
+        packet->dupacks = 0;
+        packet->sent = now;
+        packet->rto = conn->rto;
+        packet->deadline = now + packet->rto;
+        conn->window[packet->seq % conn->window_cap] = packet;
+        ++conn->inflight;
+        if (timerPush(packet)) {return -1;} 
+        paceSent(conn, packet->length, now);
+        if (nextLossBit(conn)) {
+            batch[n++] = packet;
+        } else if (debug_mode) {
+            printf("lost transmission: packet seq=%d, length=%d\n", packet->seq, packet->length);
+        }
+        //a group closes when it is full or the response has been packed completely
+        if (conn->fec) {
+            fecAdd(conn, packet);
+            if ((conn->fec_count == conn->fec || payloadDone(conn)) && (packet = fecParity(conn))) {
+                if (debug_mode) {
+                    printf("parity: group seq=%d, count=%d\n", packet->seq, (ntohl(readInt32(packet->data + 4)) >> 16) & 0xff);
+                }
+                paceSent(conn, packet->length, now);
+                if (nextLossBit(conn)) {
+                    batch[n++] = packet;
+                    parity[np++] = packet;
+                } else {
+                    packetFree(packet);
+                }
+            }
+        }
+        if (n >= UDP_BATCH - 1) {
+            sendPackets(conn, batch, n, "transmission");
+            n = 0;
+            while (np > 0) {packetFree(parity[--np]);} 
         }
-        pclose(pfp);
-        return 0;
     }
+    sendPackets(conn, batch, n, "transmission");
+    while (np > 0) {packetFree(parity[--np]);} 
+    return conn->inflight == 0 && !held;
 }
 
-int checksum(const char* file, int offset, int length, unsigned char md5_sum[] /* output checksum */ ) {
-    MD5_CTX c;
-    unsigned char buf[MAX_PACKET_SIZE]; // buffer to keep data
-    FILE* pf;
-    int n;
-    if (NULL == (pf = fopen(file, "rb"))) {
-        fprintf(stderr, "fail to open file %s", file);
-        return 1;
+struct Conn* newConn(int fd) {
+    struct Conn* conn = (struct Conn* ) malloc(sizeof(struct Conn));
+    if (NULL == conn) {return NULL;} 
+    conn->fd = fd;
+    conn->entry = NULL;
+    conn->chunk = NULL;
+    conn->zs = NULL;
+    conn->zchunk = NULL;
+    conn->leaves = NULL;
+    resetConn(conn);
+    return conn;
+}
+
+// get ready for the next request
+void resetConn(struct Conn* conn) {
+    if (conn->entry) {
+        cacheRelease(conn->entry);
+        conn->entry = NULL;
     }
-    MD5_Init(&c);
-    fseek(pf, 0, SEEK_END);
-    if (offset >= ftell(pf)) {
-        fprintf(stderr, "Error: offset is larger or equal to the size of the file\n");
-        fclose(pf);
-        return 1;
+    if (conn->zs) {
+        deflateEnd(conn->zs);
+        free(conn->zs);
+        conn->zs = NULL;
     }
-    if (length < 0) {
-        length = ftell(pf) - offset;
+    if (conn->leaves) {
+        free(conn->leaves);
+        conn->leaves = NULL;
+    }
+    conn->state = CONN_READ_HEAD;
+    conn->in_len = 0;
+    conn->in_need = 5;
+    conn->out_len = 0;
+    conn->out_sent = 0;
+    conn->body_left = 0;
+    conn->copy_body = 0;
+    conn->chunk_len = 0;
+    conn->chunk_sent = 0;
+}
+
+void closeConn(struct Conn* conn) {
+    resetConn(conn);
+    if (conn->fd >= 0) {
+        close(conn->fd);
+    }
+    free(conn->chunk);
+    free(conn->zchunk);
+    free(conn);
+}
+
+// get the next piece of a download body into user space, from the mapping when there is one
+int fillChunk(struct Conn* conn) {
+    int n = conn->body_left > CHUNK_SIZE ? CHUNK_SIZE : conn->body_left;
+    if (conn->entry->map) {
+        conn->chunk_data = conn->entry->map + conn->file_off;
     } else {
-        if (length + offset > ftell(pf)) {
-            fprintf(stderr, "Error: offset+length is larger or equal to the size of the file\n");
-            fclose(pf);
-            return 1;
-        }
+        if (NULL == conn->chunk && NULL == (conn->chunk = (char* ) malloc(CHUNK_SIZE))) {return -1;} 
+        if ((n = pread(conn->entry->fd, conn->chunk, n, conn->file_off)) < 1) {return -1;} 
+        conn->chunk_data = conn->chunk;
     }
-    fseek(pf, offset, SEEK_SET);
-    while (length > 0) {
-        if (length > sizeof(buf)) {
-            n = fread(buf, 1, sizeof(buf), pf);
-            if (n < sizeof(buf)) { 
-                length = n;
-            } 
-        } else {
-            n = fread(buf, 1, length, pf);
+    conn->chunk_len = n;
+    conn->chunk_sent = 0;
+    if (conn->zs && compressChunk(conn, conn->chunk_data, n)) {return -1;} 
+    conn->file_off += n;
+    conn->body_left -= n;
+    return 0;
+}
+
+// replace the chunk by one frame: compressed length, raw length, then n bytes of src deflated
+// and flushed so the client can inflate every frame as soon as it arrives
+int compressChunk(struct Conn* conn, const char* src, int n) {
+    if (NULL == conn->zchunk && NULL == (conn->zchunk = (char* ) malloc(8 + ZFRAME_MAX))) {return -1;} 
+    conn->zs->next_in = (Bytef* ) src;
+    conn->zs->avail_in = n;
+    conn->zs->next_out = (Bytef* ) conn->zchunk + 8;
+    conn->zs->avail_out = ZFRAME_MAX;
+    if (deflate(conn->zs, Z_SYNC_FLUSH) != Z_OK || conn->zs->avail_in || !conn->zs->avail_out) {return -1;} 
+    writeInt32(conn->zchunk, htonl(ZFRAME_MAX - conn->zs->avail_out));
+    writeInt32(conn->zchunk + 4, htonl(n));
+    conn->chunk_data = conn->zchunk;
+    conn->chunk_len = 8 + ZFRAME_MAX - conn->zs->avail_out;
+    return 0;
+}
+
+// read the request without blocking; return 0 when complete, 1 to wait, -1 on failure
+int connRead(struct Conn* conn) {
+    int n, len;
+    while (conn->in_len < conn->in_need) {
+        n = recv(conn->fd, conn->buff + conn->in_len, conn->in_need - conn->in_len, 0);
+        if (n > 0) {
+            conn->in_len += n;
+            if (conn->state == CONN_READ_HEAD && conn->in_len == 5) {
+                len = ntohl(readInt32(conn->buff + 1));
+                if (len < 0 || len > MAX_PACKET_SIZE - 6) {
+                    fprintf(stderr, "Error: illegal DataLength = %d\n", len);
+                    return -1;
+                }
+                conn->state = CONN_READ_BODY;
+                conn->in_need = 5 + len;
+            }
+        } else if (n == 0) {
+            return -1;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 1;
+        } else if (errno != EINTR) {
+            return -1;
         }
-        if (n < 1) {break;} 
-        length -= n;
-        MD5_Update(&c, buf, n);
     }
-    fclose(pf);
-    MD5_Final(md5_sum, &c);
     return 0;
 }
 
-FILE* download(const char* file, int offset, int* length) {
-    FILE* pf;
-    long len;
-
-    if (offset < 0 || 0 == *length) {return NULL;} 
-    if (NULL == (pf = fopen(file, "rb"))) {
-        fprintf(stderr, "fail to open file %s", file);
-        return NULL;
+// send the body straight from the page cache; on failure n < 0 with errno set
+int sendBody(struct Conn* conn) {
+    ssize_t n = sendfile(conn->fd, conn->entry->fd, &conn->file_off,
+        conn->body_left > SENDFILE_SIZE ? SENDFILE_SIZE : conn->body_left);
+    if (n > 0) {
+        conn->body_left -= n;
+        return n;
     }
-    len = getFileLen(pf);
-    if (offset >= len || (*length > 0 && offset + *length > len)) {
-        fclose(pf);
-        return NULL;
+    if (n == 0) {
+        errno = EIO; // file shrank under us
+        return -1;
     }
-    if (*length <= 0) { 
-		*length = len - offset;
+    if (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) {
+        //fall back to read()+send()
+        conn->copy_body = 1;
+        return 0;
     }
-    fseek(pf, offset, SEEK_SET);
-    return pf;
+    return -1;
 }
 
-void ack_or_retransmission() {
-    char ack[4 + PACKET_RESERVE_SIZE];
-    int ret;
-    socklen_t addrlen = sizeof(struct sockaddr);
-    int k, j, seq;
-    //wait for ack
-    usleep(1000 * msinterval);
-    //receive ack
-    ret = recvfrom(socket_fd, ack, sizeof(ack), MSG_DONTWAIT, (struct sockaddr* ) &clientaddr, &addrlen);
-    if (ret == sizeof(ack)) {
-        seq = ntohl(readInt32(ack));
-        for (j = 0; j < window_size; ++j) {
-            if (seq == ntohl(readInt32(packets[j].data))) //this packet is acked
-            {
-                if (debug_mode) {
-                    printf("recv ack: packet seq=%d, length=%d\n", seq, packets[j].length);
-                }
-                packets[j].length = 0;
-                packets[j].empty = 1;
-                break;
-            }
-        }
-    } else {
-        //retransmission
-        for (k = 0; k < window_size; ++k) {
-            if (!packets[k].empty) break;
+// send the response without blocking; return 0 when complete, 1 to wait, -1 on failure
+int connWrite(struct Conn* conn) {
+    int n;
+    for (;;) {
+        if (conn->out_sent < conn->out_len) {
+            n = send(conn->fd, conn->out + conn->out_sent, conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+            if (n > 0) {conn->out_sent += n;} 
+        } else if (conn->chunk_sent < conn->chunk_len) {
+            n = send(conn->fd, conn->chunk_data + conn->chunk_sent, conn->chunk_len - conn->chunk_sent, MSG_NOSIGNAL);
+            if (n > 0) {conn->chunk_sent += n;} 
+        } else if (conn->body_left > 0 && !conn->copy_body) {
+            if ((n = sendBody(conn)) == 0) {continue;} 
+        } else if (conn->body_left > 0) {
+            if (fillChunk(conn)) {return -1;} 
+            continue;
+        } else {
+            return 0;
         }
-        if (k == window_size) {return;} 
-        sendto(socket_fd, packets[k].data, packets[k].length, 0, (struct sockaddr* ) &clientaddr, addrlen);
-        if (debug_mode) {
-            printf("retransmission: packet seq=%d, length=%d\n", readInt32(packets[k].data), packets[k].length);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {return 1;} 
+            if (errno != EINTR) {return -1;} 
         }
     }
 }
 
-int usend(const char* src, long length) {
-    const int MAX_SEND = MAX_PACKET_SIZE - 4 - PACKET_RESERVE_SIZE;
-    char packet[MAX_PACKET_SIZE];
-    char ack[4 + PACKET_RESERVE_SIZE];
+// drive a connection through its states as far as the socket allows,
+// connections are kept alive and pipelined requests are answered in order
+void connProgress(struct Conn* conn) {
     int ret;
-    socklen_t addrlen = sizeof(struct sockaddr);
-    int send;
-    int k, j, seq;
-    for (; length > 0;) {
-        send = length > MAX_SEND ? MAX_SEND : length;
-        //search for an empty packet
-        for (k = 0; k < window_size; ++k) {
-            if (packets[k].empty) break;
-        }
-        //all packets aren't acked
-        if (k == window_size) {
-            ack_or_retransmission();
-        } else {
-            //send a packet
-            packets[k].length = send + 4 + PACKET_RESERVE_SIZE;
-            packets[k].empty = 0;
-            writeInt32(packets[k].data, htonl(packet_seq++));
-            memset(packets[k].data + 4, 0, PACKET_RESERVE_SIZE);
-            memcpy(packets[k].data + 4 + PACKET_RESERVE_SIZE, src, send);
-            length -= send;
-            src += send;
-            if (nextLossBit()) {
-                sendto(socket_fd, packets[k].data, packets[k].length, 0,
-                    (struct sockaddr* ) &clientaddr, addrlen);
-                if (debug_mode) {
-                    printf("transmission: packet seq=%d, length=%d\n",
-                        ntohl(readInt32(packets[k].data)), packets[k].length);
-                }
-            } else {
-                if (debug_mode) {
-                    printf("lost transmission: packet seq=%d, length=%d\n",
-                        ntohl(readInt32(packets[k].data)), packets[k].length);
-                }
-            }
+    for (;;) {
+        if (conn->state == CONN_HASHING) {return;} 
+        if (conn->state != CONN_WRITE) {
+            if ((ret = connRead(conn)) > 0) {return;} 
+            if (ret < 0) {break;} 
+            conn->state = CONN_WRITE;
+            if (queueHash(conn)) {return;} 
+            handleMsg(conn);
         }
+        if ((ret = connWrite(conn)) > 0) {return;} 
+        if (ret < 0) {break;} 
+        resetConn(conn);
     }
+    closeConn(conn);
+}
 
-    for (;;) {
-        //search for un-acked packet
-        for (k = 0; k < window_size; ++k) {
-            if (!packets[k].empty) {
-				break;
-			} 
-        }
-        if (k < window_size) {
-            ack_or_retransmission();
-        } else { 
-            break;
-        } 
-    }
+//queue a response message, it is sent by the TCP or UDP event loop
+int tsend(struct Conn* conn, const char* src, long length) {
+    if (length > sizeof(conn->out) - conn->out_len) {return -1;} 
+    memcpy(conn->out + conn->out_len, src, length);
+    conn->out_len += length;
     return length;
 }
 
-int tsend(const char* src, long length) {
-    if (udp) {
-        return usend(src, length);
-    } else {
-        return send(connect_fd, src, length, 0);
-    }
+unsigned int sessionHash(const struct sockaddr_in* addr) {
+    return (ntohl(addr->sin_addr.s_addr) * 2654435761u ^ ntohs(addr->sin_port)) % SESSION_BUCKETS;
 }
 
-int trecv(char* dst, long max_length) {
-    char packet[MAX_PACKET_SIZE];
-    //struct sockaddr_in peer;
-    socklen_t addrlen = sizeof(struct sockaddr_in);
-    int ret;
-    if (udp) {
-        ret = recvfrom(socket_fd, packet, MAX_PACKET_SIZE, 0, (struct sockaddr* ) &clientaddr, &addrlen);
-        if (addrlen != sizeof(clientaddr)) {return -1;} 
-        if (ret < 4 + PACKET_RESERVE_SIZE) {return -1;} 
-        ret -= 4 + PACKET_RESERVE_SIZE;
-        memcpy(dst, packet + 4 + PACKET_RESERVE_SIZE, ret);
-        if (debug_mode) {
-            printf("recv packet, seq=%d, length=%d\n", ntohl(readInt32(packet)), ret);
+struct Conn* findSession(const struct sockaddr_in* addr) {
+    struct Conn* conn;
+    for (conn = session_table[sessionHash(addr)]; conn; conn = conn->hnext) {
+        if (conn->peer.sin_addr.s_addr == addr->sin_addr.s_addr && conn->peer.sin_port == addr->sin_port) {
+            return conn;
         }
-        return ret;
-    } else {
-        return recv(connect_fd, dst, max_length, 0);
     }
+    return NULL;
 }
 
-int readData(char* buf, int length) {
-    int n, read;
-    while (length > 0) {
-        n = trecv(buf, length);
-        if (n < 1) {return -1;} 
-        length -= n;
-        buf += n;
+// MTU of the route to addr, read from a connected UDP socket that never sends; 0 if unknown
+int pathMtu(const struct sockaddr_in* addr) {
+    int fd, mtu = 0, pmtu = IP_PMTUDISC_DO;
+    socklen_t len = sizeof(mtu);
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {return 0;} 
+    setsockopt(fd, IPPROTO_IP, IP_MTU_DISCOVER, &pmtu, sizeof(pmtu));
+    if (connect(fd, (const struct sockaddr* ) addr, sizeof(*addr)) == -1 || getsockopt(fd, IPPROTO_IP, IP_MTU, &mtu, &len) == -1) {
+        mtu = 0;
     }
-    return 0;
+    close(fd);
+    return mtu;
 }
 
-//read a complete messge
-int readMsg(char* buf) {
-    int n, read, len;
-    if (udp) {
-        return trecv(buf, MAX_PACKET_SIZE) < 0;
-    } else {
-        if (readData(buf, 5)) {return -1;} 
-        len = ntohl(readInt32(buf + 1));
-        return readData(buf + 5, len);
+// flags is the reserved field of the request: the session's datagrams are as large as the
+// client accepts, -s allows and the route to the client carries unfragmented
+struct Conn* newSession(const struct sockaddr_in* addr, unsigned int flags) {
+    struct Conn* conn;
+    unsigned int h = sessionHash(addr);
+    int mtu = pathMtu(addr) - IP_UDP_HEADERS;
+    if (NULL == (conn = newConn(-1))) {return NULL;} 
+    conn->datagram = flags & REQ_SIZE_MASK ? flags & REQ_SIZE_MASK : MAX_PACKET_SIZE;
+    if (conn->datagram > datagram_max) {conn->datagram = datagram_max;} 
+    if (conn->datagram > mtu && mtu >= DATAGRAM_MIN) {conn->datagram = mtu & REQ_SIZE_MASK;} 
+    if (conn->datagram < DATAGRAM_MIN) {conn->datagram = DATAGRAM_MIN;} 
+    conn->rwnd = flags >> REQ_WINDOW_SHIFT ? flags >> REQ_WINDOW_SHIFT : RECV_WINDOW;
+    if (conn->rwnd > RECV_WINDOW) {conn->rwnd = RECV_WINDOW;} 
+    for (conn->window_cap = 16; conn->window_cap < window_size; conn->window_cap *= 2);
+    if (NULL == (conn->window = (struct Data_Packet** ) calloc(conn->window_cap, sizeof(struct Data_Packet*)))) {
+        closeConn(conn);
+        return NULL;
+    }
+    conn->peer = *addr;
+    conn->packet_seq = INITIAL_SEQ;
+    conn->snd_una = INITIAL_SEQ;
+    conn->inflight = 0;
+    conn->loss_bit = 0;
+    conn->loss_left = 0;
+    conn->ready = 0;
+    conn->failed = 0;
+    conn->srtt = 0;
+    conn->rttvar = 0;
+    conn->rto = (long long) msinterval * 1000;
+    conn->rtt_min = 0;
+    conn->rtt_max = 0;
+    conn->rtt_samples = 0;
+    conn->timeouts = 0;
+    conn->fast_retransmits = 0;
+    conn->nak_resends = 0;
+    conn->crc = (flags & REQ_CAP_CRC) != 0;
+    conn->recover_seq = INITIAL_SEQ;
+    conn->fec = 0;
+    conn->fec_parity = NULL;
+    conn->fec_count = 0;
+    conn->pace_next = 0;
+    conn->tokens = session_rate * BUCKET_DEPTH;
+    conn->tokens_stamp = nowUs();
+    conn->pace_at = 0;
+    conn->ge_state = 0;
+    conn->link_free = 0;
+    cc->init(conn);
+    conn->traced_cwnd = 0;
+    conn->traced_ssthresh = 0;
+    traceCwnd(conn, nowUs());
+    conn->hnext = session_table[h];
+    session_table[h] = conn;
+    markReady(conn);
+    return conn;
+}
+
+// unlink from the hash table, disarm its timers and free; the session must not be on the ready list
+void dropSession(struct Conn* conn) {
+    struct Conn** pp;
+    struct Data_Packet* packet;
+    int seq;
+    for (pp = &session_table[sessionHash(&conn->peer)]; *pp; pp = &(*pp)->hnext) {
+        if (*pp == conn) {
+            *pp = conn->hnext;
+            break;
+        }
+    }
+    for (seq = conn->snd_una; seq < conn->packet_seq; ++seq) {
+        if ((packet = conn->window[seq % conn->window_cap])) {
+            timerRemove(packet);
+            packetFree(packet);
+        }
+    }
+    if (conn->fec_parity) {packetFree(conn->fec_parity);} 
+    paceRelease(conn);
+    free(conn->window);
+    if (pf_cctrace) {fflush(pf_cctrace);} 
+    closeConn(conn);
+}
+
+// demultiplex all pending datagrams by peer: ACKs go to the peer's window, a request starts a session
+void recvDatagrams() {
+    char packet[MAX_PACKET_SIZE];
+    struct sockaddr_in peer;
+    socklen_t addrlen;
+    struct Conn* conn;
+    int ret, len;
+    for (;;) {
+        addrlen = sizeof(peer);
+        ret = recvfrom(socket_fd, packet, MAX_PACKET_SIZE, MSG_DONTWAIT, (struct sockaddr* ) &peer, &addrlen);
+        if (ret < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                fprintf(stderr, "recvfrom error: %s(errno: %d)\n", strerror(errno), errno);
+            }
+            return;
+        }
+        if (addrlen != sizeof(peer) || ret < 4 + PACKET_RESERVE_SIZE) {continue;} 
+        conn = findSession(&peer);
+        if (ret == 4 + PACKET_RESERVE_SIZE || (ntohl(readInt32(packet + 4)) & ACK_FLAG_SACK)) {
+            if (conn) {recvAck(conn, packet, ret);} 
+            continue;
+        }
+        ret -= 4 + PACKET_RESERVE_SIZE;
+        if (debug_mode) {
+            printf("recv packet, seq=%d, length=%d\n", ntohl(readInt32(packet)), ret);
+        }
+        if (conn) {
+            fprintf(stderr, "Error: request received while a response is still being sent. Ignored.\n");
+            continue;
+        }
+        len = ntohl(readInt32(packet + 4 + PACKET_RESERVE_SIZE + 1));
+        if (ret < 5 || len < 0 || 5 + len > ret) {
+            fprintf(stderr, "fail to get message from client\n");
+            continue;
+        }
+        if (NULL == (conn = newSession(&peer, ntohl(readInt32(packet + 4))))) {
+            fprintf(stderr, "fail to allocate memory: %s(errno: %d)\n", strerror(errno), errno);
+            continue;
+        }
+        if (fec_group && (ntohl(readInt32(packet + 4)) & REQ_CAP_FEC) && (conn->fec_parity = packetAlloc(conn->datagram))) {
+            conn->fec = fec_group;
+        }
+        memcpy(conn->buff, packet + 4 + PACKET_RESERVE_SIZE, ret);
+        conn->state = CONN_WRITE;
+        handleMsg(conn);
     }
 }
 
-void respFiletype() {
+void respFiletype(struct Conn* conn) {
     char out[MAXLINE];
-    int len = ntohl(readInt32(buff + 1));
-    const char* file = &buff[5];
-    buff[5 + len] = '\0';
+    int len = ntohl(readInt32(conn->buff + 1));
+    const char* file = &conn->buff[5];
+    conn->buff[5 + len] = '\0';
     if (debug_mode) {
         fprintf(stdout, "%-12s\t:\t%-12s received with DataLength = %d, Data = '%s'\n", "FILETYPE_REQ", "FILETYPE_REQ", len, file);
     }
@@ -425,7 +2560,7 @@ void respFiletype() {
             writeInt32(out + 1, htonl(len));
         }
     }
-    tsend(out, len + 5);
+    tsend(conn, out, len + 5);
     if (debug_mode) {
         if (out[0] == (char) FILETYPE_ERR) {
             fprintf(stdout, "%-12s\t:\t%-12s sent with DataLength = %d\n", "FILETYPE_ERR", "FILETYPE_ERR", len);
@@ -435,74 +2570,142 @@ void respFiletype() {
     }
 }
 
-void respChecksum() {
+// CHECKSUM_AREQ has the hash algorithm in the byte before the filename, CHECKSUM_REQ is MD5;
+// the DataLength of CHECKSUM_RSP is the digest size of the algorithm
+void respChecksum(struct Conn* conn) {
     char out[MAXLINE];
-    int data_len = ntohl(readInt32(buff + 1));
-    int offset = ntohl(readInt32(buff + 5));
-    int length = ntohl(readInt32(buff + 9));
-    const char* file = &buff[13];
-    buff[5 + data_len] = '\0';
+    char hex[2 * EVP_MAX_MD_SIZE + 1];
+    int areq = (conn->buff[0] & 0xff) == CHECKSUM_AREQ;
+    int data_len = ntohl(readInt32(conn->buff + 1));
+    int head = areq ? 9 : 8; // offset, length and the algorithm of a CHECKSUM_AREQ come before the filename
+    int offset = ntohl(readInt32(conn->buff + 5));
+    int length = ntohl(readInt32(conn->buff + 9));
+    const struct HashAlgo* algo = areq ? hashFind(conn->buff[13] & 0xff) : hashFind(HASH_MD5);
+    const char* file = data_len >= head ? &conn->buff[5 + head] : "";
+    conn->buff[5 + data_len] = '\0';
     if (debug_mode) {
-        fprintf(stdout, "%-12s\t:\t%-12s received with DataLength = %d,offset = %d,length = %d,filename = '%s'\n", "CHECKSUM_REQ", "CHECKSUM_REQ", data_len, offset, length, file);
+        fprintf(stdout, "%-12s\t:\t%-12s received with DataLength = %d,offset = %d,length = %d,algorithm = %s,filename = '%s'\n",
+            areq ? "CHECKSUM_AREQ" : "CHECKSUM_REQ", areq ? "CHECKSUM_AREQ" : "CHECKSUM_REQ", data_len, offset, length,
+            algo ? algo->name : "?", file);
     }
-    if ((validFileName(file) && offset >= 0) && (!checksum(file, offset, length, out + 5))) {
+    if ((data_len >= head && validFileName(file) && offset >= 0 && algo) && (!checksum(file, offset, length, algo, (unsigned char* ) out + 5, &data_len))) {
         out[0] = (char) CHECKSUM_RSP;
-        data_len = 16;
     } else {
         fprintf(stderr, "Error: fail to checksum for %s\n", file);
         out[0] = (char) CHECKSUM_ERR;
         data_len = 0;
     }
     writeInt32(out + 1, htonl(data_len));
-    tsend(out, data_len + 5);
+    tsend(conn, out, data_len + 5);
     if (debug_mode) {
         if (out[0] == (char) CHECKSUM_ERR) {
             fprintf(stdout, "%-12s\t:\t%-12s sent with DataLength = %d\n",
                 "CHECKSUM_ERR", "CHECKSUM_ERR", data_len);
         } else {
             fprintf(stdout, "%-12s\t:\t%-12s sent with DataLength = %d, checksum = %s\n",
-                "CHECKSUM_RSP", "CHECKSUM_RSP", data_len, strToHex(out + 5));
+                "CHECKSUM_RSP", "CHECKSUM_RSP", data_len, strToHex(out + 5, data_len, hex));
+        }
+    }
+}
+
+// CHECKSUM_TREE_REQ: offset, length, chunk size (0 for TREE_CHUNK), flags, filename;
+// CHECKSUM_TREE_RSP: chunk size, chunks, root, then the chunk digests if TREE_FLAG_LEAVES
+void respTreeChecksum(struct Conn* conn) {
+    char out[MAXLINE];
+    char hex[33];
+    unsigned char* leaves;
+    int data_len = ntohl(readInt32(conn->buff + 1));
+    int offset = ntohl(readInt32(conn->buff + 5));
+    int length = ntohl(readInt32(conn->buff + 9));
+    int chunk = ntohl(readInt32(conn->buff + 13));
+    int flags = conn->buff[17];
+    int count;
+    const char* file = &conn->buff[18];
+    conn->buff[5 + data_len] = '\0';
+    if (debug_mode) {
+        fprintf(stdout, "%-12s\t:\t%-12s received with DataLength = %d, offset = %d, length = %d, chunk = %d, flags = 0x%02x, filename = '%s'\n",
+            "CHECKSUM_TREE_REQ", "CHECKSUM_TREE_REQ", data_len, offset, length, chunk, flags & 0xff, file);
+    }
+    if (chunk == 0) {chunk = TREE_CHUNK;} 
+    if (data_len >= 13 && validFileName(file) && offset >= 0 && chunk >= TREE_CHUNK_MIN && chunk <= TREE_CHUNK_MAX
+        && !(chunk & (chunk - 1)) && !treeChecksum(file, offset, length, &chunk, &count, &leaves, (unsigned char* ) out + 13)) {
+        out[0] = (char) CHECKSUM_TREE_RSP;
+        data_len = 24;
+        writeInt32(out + 5, htonl(chunk));
+        writeInt32(out + 9, htonl(count));
+        if (flags & TREE_FLAG_LEAVES) {
+            //the digests follow the head as the body
+            data_len += 16 * count;
+            conn->leaves = leaves;
+            conn->chunk_data = (const char* ) leaves;
+            conn->chunk_len = 16 * count;
+            conn->chunk_sent = 0;
+        } else {
+            free(leaves);
+        }
+    } else {
+        fprintf(stderr, "Error: fail to tree checksum for %s\n", file);
+        out[0] = (char) CHECKSUM_TREE_ERR;
+        data_len = 0;
+    }
+    writeInt32(out + 1, htonl(data_len));
+    tsend(conn, out, data_len > 24 ? 29 : data_len + 5);
+    if (debug_mode) {
+        if (out[0] == (char) CHECKSUM_TREE_ERR) {
+            fprintf(stdout, "%-12s\t:\t%-12s sent with DataLength = %d\n",
+                "CHECKSUM_TREE_ERR", "CHECKSUM_TREE_ERR", data_len);
+        } else {
+            fprintf(stdout, "%-12s\t:\t%-12s sent with DataLength = %d, chunk = %d, chunks = %d, root = %s\n",
+                "CHECKSUM_TREE_RSP", "CHECKSUM_TREE_RSP", data_len, chunk, count, strToHex(out + 13, 16, hex));
         }
     }
 }
 
-void respDownload() {
+void respDownload(struct Conn* conn) {
     char out[MAXLINE];
-    char* filedata;
-    int data_len = ntohl(readInt32(buff + 1));
-    int offset = ntohl(readInt32(buff + 5));
-    int length = ntohl(readInt32(buff + 9));
+    int zreq = (conn->buff[0] & 0xff) == DOWNLOAD_ZREQ;
+    int data_len = ntohl(readInt32(conn->buff + 1));
+    int offset = ntohl(readInt32(conn->buff + 5));
+    int length = ntohl(readInt32(conn->buff + 9));
+    int codecs = zreq ? conn->buff[13] : 0;
     int len;
-    FILE* pf;
-    const char* file = &buff[13];
-    buff[5 + data_len] = '\0';
+    struct CacheEntry* entry;
+    const char* file = &conn->buff[zreq ? 14 : 13];
+    const char* rsp = "DOWNLOAD_RSP";
+    conn->buff[5 + data_len] = '\0';
     if (debug_mode) {
         fprintf(stdout,
-            "%-12s\t:\t%-12s received with DataLength = %d, offset = %d, length = %d, filename = '%s'\n", "DOWNLOAD_REQ", "DOWNLOAD_REQ", data_len, offset, length, file);
+            "%-12s\t:\t%-12s received with DataLength = %d, offset = %d, length = %d, filename = '%s'\n",
+            zreq ? "DOWNLOAD_ZREQ" : "DOWNLOAD_REQ", zreq ? "DOWNLOAD_ZREQ" : "DOWNLOAD_REQ", data_len, offset, length, file);
     }
-    if ((validFileName(file) && offset >= 0) && NULL != (pf = download(file, offset, &length))) {
+    if ((validFileName(file) && offset >= 0) && NULL != (entry = download(file, offset, &length))) {
         out[0] = (char) DOWNLOAD_RSP;
+        if (codecs & ZCODEC_DEFLATE) {
+            if (NULL != (conn->zs = (z_stream* ) calloc(1, sizeof(z_stream)))
+                && deflateInit(conn->zs, DEFLATE_LEVEL) == Z_OK) {
+                //DataLength stays the uncompressed length, the body is a sequence of frames
+                out[0] = (char) DOWNLOAD_ZRSP;
+                rsp = "DOWNLOAD_ZRSP";
+                conn->copy_body = 1;
+            } else {
+                free(conn->zs);
+                conn->zs = NULL;
+            }
+        }
         data_len = length;
         writeInt32(out + 1, htonl(data_len));
         len = data_len;
-        //send head
-        tsend(out, 5);
-        //send data
-        filedata = (char * ) malloc(1 << 16);
-        while (length > 0) {
-            data_len = length > (1 << 16) ? (1 << 16) : length;
-            data_len = fread(filedata, 1, data_len, pf);
-            length -= data_len;
-            tsend(filedata, data_len);
-        }
-        free(filedata);
-        fclose(pf);
+        //send head, the body is streamed from the file afterwards
+        tsend(conn, out, 5);
+        conn->entry = entry;
+        conn->file_off = offset;
+        conn->body_left = length;
     } else {
         fprintf(stderr, "Error: fail to download %s\n", file);
         out[0] = (char) DOWNLOAD_ERR;
         data_len = 0;
         writeInt32(out + 1, htonl(data_len));
-        tsend(out, data_len + 5);
+        tsend(conn, out, data_len + 5);
     }
     if (debug_mode) {
         if (out[0] == (char) DOWNLOAD_ERR) {
@@ -512,32 +2715,74 @@ void respDownload() {
         } else {
             fprintf(stdout,
                 "%-12s\t:\t%-12s sent with DataLength = %d\n",
-                "DOWNLOAD_RSP", "DOWNLOAD_RSP", len);
+                rsp, rsp, len);
+        }
+    }
+}
+
+void respFilesize(struct Conn* conn) {
+    char out[MAXLINE];
+    struct CacheEntry* entry = NULL;
+    int len = ntohl(readInt32(conn->buff + 1));
+    const char* file = &conn->buff[5];
+    conn->buff[5 + len] = '\0';
+    if (debug_mode) {
+        fprintf(stdout, "%-12s\t:\t%-12s received with DataLength = %d, Data = '%s'\n", "FILESIZE_REQ", "FILESIZE_REQ", len, file);
+    }
+    if (validFileName(file) && NULL != (entry = cacheGet(file)) && entry->size <= 0x7fffffff) {
+        out[0] = (char) FILESIZE_RSP;
+        len = 4;
+        writeInt32(out + 5, htonl(entry->size));
+    } else {
+        fprintf(stderr, "Error: fail to get size of %s\n", file);
+        out[0] = (char) FILESIZE_ERR;
+        len = 0;
+    }
+    if (entry) {cacheRelease(entry);} 
+    writeInt32(out + 1, htonl(len));
+    tsend(conn, out, len + 5);
+    if (debug_mode) {
+        if (out[0] == (char) FILESIZE_ERR) {
+            fprintf(stdout, "%-12s\t:\t%-12s sent with DataLength = %d\n", "FILESIZE_ERR", "FILESIZE_ERR", len);
+        } else {
+            fprintf(stdout, "%-12s\t:\t%-12s sent with DataLength = %d, size = %d\n", "FILESIZE_RSP", "FILESIZE_RSP", len, ntohl(readInt32(out + 5)));
         }
     }
 }
 
-void TCPserver() {
-    if ((socket_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+void TCPserver(struct Worker* worker) {
+    int on = 1;
+    int fd;
+    if ((fd = worker->socket_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
         fprintf(stderr, "create socket error: %s(errno: %d)\n", strerror(errno), errno);
         exit(0);
     }
+    //every worker binds its own listening socket, the kernel spreads connections over them
+    if (workers > 1 && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+        fprintf(stderr, "setsockopt error: %s(errno: %d)\n", strerror(errno), errno);
+        exit(0);
+    }
     memset(&servaddr, 0, sizeof(servaddr));
     servaddr.sin_family = AF_INET;
     servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
     servaddr.sin_port = htons(port);
-    if (bind(socket_fd, (struct sockaddr* ) &servaddr, sizeof(servaddr)) == -1) {
+    if (bind(fd, (struct sockaddr* ) &servaddr, sizeof(servaddr)) == -1) {
         fprintf(stderr, "bind socket error: %s(errno: %d)\n", strerror(errno), errno);
         exit(0);
     }
-    if (listen(socket_fd, 10) == -1) {
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) == -1) {
+        fprintf(stderr, "fcntl socket error: %s(errno: %d)\n", strerror(errno), errno);
+        exit(0);
+    }
+    if (listen(fd, SOMAXCONN) == -1) {
         fprintf(stderr, "listen socket error: %s(errno: %d)\n", strerror(errno), errno);
         exit(0);
     }
 }
 
 void UDPserver() {
-    int k;
+    int rcvbuf = UDP_RCVBUF;
+    unsigned long pacing_rate = (unsigned long) (total_rate * 1000000);
     if ((socket_fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
         fprintf(stderr, "create socket error: %s(errno: %d)\n", strerror(errno), errno);
         exit(1);
@@ -551,76 +2796,225 @@ void UDPserver() {
         fprintf(stderr, "bind socket error: %s(errno: %d)\n", strerror(errno), errno);
         exit(1);
     }
-    setLossMode();
-    packets = (struct Data_Packet* ) malloc(window_size* sizeof(struct Data_Packet));
-    if (NULL == packets) {
-        close(socket_fd);
-        fprintf(stderr, "fail to allocate memory: %s(errno: %d)\n", strerror(errno), errno);
-        exit(1);
+    //ACKs of every session queue up on this one socket
+    setsockopt(socket_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    //with an fq qdisc the kernel enforces the total rate too, without it the option does nothing
+    if (total_rate > 0) {
+        setsockopt(socket_fd, SOL_SOCKET, SO_MAX_PACING_RATE, &pacing_rate, sizeof(pacing_rate));
     }
-    memset(packets, 0, window_size* sizeof(struct Data_Packet));
-    for (k = 0; k < window_size; ++k) {
-        packets[k].data = (char*) malloc(MAX_PACKET_SIZE);
-        packets[k].length = 0;
-        packets[k].empty = 1;
+    total_stamp = nowUs();
+    total_tokens = total_rate * BUCKET_DEPTH;
+    setLossMode();
+    if (cc_trace[0]) {
+        if (NULL == (pf_cctrace = fopen(cc_trace, "w"))) {
+            fprintf(stderr, "open %s error: %s(errno: %d)\n", cc_trace, strerror(errno), errno);
+            exit(1);
+        }
+        fprintf(pf_cctrace, "# us peer cwnd ssthresh inflight srtt_us (%s)\n", cc->name);
     }
 }
 
 void setServeMode() {
+    int k;
     if (udp) {
         UDPserver();
     } else {
-        TCPserver();
+        for (k = 0; k < workers; ++k) {
+            worker_list[k].id = k;
+            TCPserver(&worker_list[k]);
+        }
     }
 }
 
-int taccept() {
-    if (udp) {
-        return 0;
-    } else {
-        return (connect_fd = accept(socket_fd, (struct sockaddr * ) NULL, NULL)) == -1;
+void handleMsg(struct Conn* conn) {
+    int len = ntohl(readInt32(conn->buff + 1));
+    conn->buff[5 + len] = '\0';
+    switch (conn->buff[0] & 0xff) {
+    case FILETYPE_REQ:
+        respFiletype(conn);
+        break;
+    case CHECKSUM_REQ:
+    case CHECKSUM_AREQ:
+        respChecksum(conn);
+        break;
+    case CHECKSUM_TREE_REQ:
+        respTreeChecksum(conn);
+        break;
+    case DOWNLOAD_REQ:
+    case DOWNLOAD_ZREQ:
+        respDownload(conn);
+        break;
+    case FILESIZE_REQ:
+        respFilesize(conn);
+        break;
+    default:
+        fprintf(stdout, "%-12s\t:\t%-12sMessage with MessageType = 0x%02x received. Ignored.\n", "?", "?", (conn->buff[0] & 0xff));
+        conn->buff[0] = (char) UNKNOWN_FAIL;
+        writeInt32(conn->buff + 1, 0);
+        tsend(conn, conn->buff, 5);
+        fprintf(stdout, "%-12s\t:\t%-12s sent with DataLength = %d\n", "UNKNOWN_FAIL", "UNKNOWN_FAIL", 0);
+        break;
     }
 }
 
-void serve() {
-    setServeMode();
-    int n, len, type, read;
-    char out[MAXLINE];
+void acceptConns(struct Worker* worker) {
+    struct epoll_event ev;
+    struct Conn* conn;
+    int fd;
+    for (;;) {
+        if ((fd = accept4(worker->socket_fd, (struct sockaddr * ) NULL, NULL, SOCK_NONBLOCK)) == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {continue;} 
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                fprintf(stderr, "accept socket error: %s(errno: %d)\n", strerror(errno), errno);
+            }
+            return;
+        }
+        if (NULL == (conn = newConn(fd))) {
+            fprintf(stderr, "fail to allocate memory: %s(errno: %d)\n", strerror(errno), errno);
+            close(fd);
+            continue;
+        }
+        conn->worker = worker;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            fprintf(stderr, "epoll_ctl error: %s(errno: %d)\n", strerror(errno), errno);
+            closeConn(conn);
+            continue;
+        }
+        connProgress(conn);
+    }
+}
+
+//edge-triggered event loop, every connection advances as far as its socket allows
+void* serveTCP(void* arg) {
+    struct Worker* worker = (struct Worker* ) arg;
+    struct epoll_event ev, events[MAX_EVENTS];
+    cpu_set_t cpus;
+    int n, k;
+    if (pin_cpu) {
+        CPU_ZERO(&cpus);
+        CPU_SET(worker->id % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+        if ((errno = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus))) {
+            fprintf(stderr, "fail to pin worker %d: %s(errno: %d)\n", worker->id, strerror(errno), errno);
+        }
+    }
+    if ((worker->epoll_fd = epoll_create1(0)) == -1) {
+        fprintf(stderr, "epoll_create error: %s(errno: %d)\n", strerror(errno), errno);
+        exit(1);
+    }
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->socket_fd, &ev) == -1) {
+        fprintf(stderr, "epoll_ctl error: %s(errno: %d)\n", strerror(errno), errno);
+        exit(1);
+    }
+    pthread_mutex_init(&worker->lock, NULL);
+    worker->hashed = NULL;
+    if ((worker->event_fd = eventfd(0, EFD_NONBLOCK)) == -1) {
+        fprintf(stderr, "eventfd error: %s(errno: %d)\n", strerror(errno), errno);
+        exit(1);
+    }
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = worker;
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->event_fd, &ev) == -1) {
+        fprintf(stderr, "epoll_ctl error: %s(errno: %d)\n", strerror(errno), errno);
+        exit(1);
+    }
     while (1) {
-        if (taccept()) {
-            fprintf(stderr, "accept socket error: %s(errno: %d)", strerror(errno), errno);
+        n = epoll_wait(worker->epoll_fd, events, MAX_EVENTS, -1);
+        pollCacheStats();
+        if (n == -1) {
+            if (errno == EINTR) {continue;} 
+            fprintf(stderr, "epoll_wait error: %s(errno: %d)\n", strerror(errno), errno);
             break;
         }
-        if (!readMsg(buff)) {
-            len = ntohl(readInt32(buff + 1));
-            buff[5 + len] = '\0';
-            switch (buff[0] & 0xff) {
-            case FILETYPE_REQ:
-                respFiletype();
-                break;
-            case CHECKSUM_REQ:
-                respChecksum();
-                break;
-            case DOWNLOAD_REQ:
-                respDownload();
-                break;
-            default:
-                fprintf(stdout, "%-12s\t:\t%-12sMessage with MessageType = 0x%02x received. Ignored.\n", "?", "?", (buff[0] & 0xff));
-                buff[0] = (char) UNKNOWN_FAIL;
-                writeInt32(buff + 1, 0);
-                tsend(buff, 5);
-                fprintf(stdout, "%-12s\t:\t%-12s sent with DataLength = %d\n", "UNKNOWN_FAIL", "UNKNOWN_FAIL", 0);
-                break;
+        for (k = 0; k < n; ++k) {
+            if (NULL == events[k].data.ptr) {
+                acceptConns(worker);
+            } else if (events[k].data.ptr == worker) {
+                finishHashed(worker);
+            } else {
+                connProgress((struct Conn* ) events[k].data.ptr);
+            }
+        }
+    }
+    close(worker->epoll_fd);
+    return NULL;
+}
+
+//one socket serves every UDP session; ppoll() sleeps until a datagram arrives, the earliest
+//retransmission deadline or a held back session may send again, then every queued ACK is
+//applied, expired packets are resent and sessions with free window slots are refilled
+void serveUDP() {
+    struct pollfd pfd;
+    struct timespec ts;
+    struct Conn* conn;
+    long long now, wait, held;
+    int ret;
+    pfd.fd = socket_fd;
+    pfd.events = POLLIN;
+    while (1) {
+        now = nowUs();
+        wait = timerTimeout(now);
+        if ((held = paceTimeout(now)) >= 0 && (wait < 0 || held < wait)) {wait = held;} 
+        if ((held = netemTimeout(now)) >= 0 && (wait < 0 || held < wait)) {wait = held;} 
+        ts.tv_sec = wait / 1000000;
+        ts.tv_nsec = wait % 1000000 * 1000;
+        if (ppoll(&pfd, 1, wait < 0 ? NULL : &ts, NULL) == -1 && errno != EINTR) {
+            fprintf(stderr, "poll error: %s(errno: %d)\n", strerror(errno), errno);
+            break;
+        }
+        pollCacheStats();
+        recvDatagrams();
+        now = nowUs();
+        retransmission(now);
+        netemFlush(now);
+        paceWake(now);
+        while ((conn = ready_sessions)) {
+            ready_sessions = conn->next;
+            conn->ready = 0;
+            if (conn->failed) {
+                fprintf(stderr, "Error: no ACK from %s:%d, session dropped\n",
+                    inet_ntoa(conn->peer.sin_addr), ntohs(conn->peer.sin_port));
+                ret = -1;
+            } else {
+                ret = usend(conn);
+            }
+            if (ret) {
+                if (debug_mode) {printRttStats(conn);} 
+                dropSession(conn);
             }
-        } else {
-            fprintf(stderr, "fail to get message from client\n");
         }
-        if (!udp) {close(connect_fd);} 
     }
-    close(socket_fd);
 }
 
-// tserver [-udp loss_model] [-w window] [-r msinterval] [-d] [-t seconds] port
+void serve() {
+    int k;
+    setServeMode();
+    startHashPool();
+    crc32cInit();
+    if (udp) {
+        serveUDP();
+        close(socket_fd);
+        return;
+    }
+    for (k = 1; k < workers; ++k) {
+        if ((errno = pthread_create(&worker_list[k].thread, NULL, serveTCP, &worker_list[k]))) {
+            fprintf(stderr, "fail to start worker %d: %s(errno: %d)\n", k, strerror(errno), errno);
+            exit(1);
+        }
+    }
+    serveTCP(&worker_list[0]);
+    for (k = 1; k < workers; ++k) {
+        pthread_join(worker_list[k].thread, NULL);
+    }
+    for (k = 0; k < workers; ++k) {
+        close(worker_list[k].socket_fd);
+    }
+}
+
+// tserver [-udp loss_model] [-w window] [-r msinterval] [-cc algorithm] [-cctrace file] [-fec group] [-s size] [-pace] [-rate mbps] [-total mbps] [-netem spec] [-j workers [-pin]] [-hash threads] [-m megabytes] [-d] [-t seconds] port
 void parseArg(int argc, char * argv[]) {
     int k;
     for (k = 1; k < argc; ++k) {
@@ -651,6 +3045,105 @@ void parseArg(int argc, char * argv[]) {
                 exit(1);
             }
             udp = 1;
+        } else if (0 == strcmp("-cc", argv[k])) {
+            if (k + 1 == argc) {
+                fprintf(stderr, "error: need congestion control algorithm\n");
+                exit(1);
+            }
+            ++k;
+            for (cc = cc_list; cc < cc_list + CC_COUNT && strcmp(cc->name, argv[k]); ++cc);
+            if (cc == cc_list + CC_COUNT) {
+                fprintf(stderr, "error: illegal congestion control algorithm! (fixed, reno, cubic or bbr)\n");
+                exit(1);
+            }
+            udp = 1;
+        } else if (0 == strcmp("-cctrace", argv[k])) {
+            if (k + 1 == argc) {
+                fprintf(stderr, "error: need trace file\n");
+                exit(1);
+            }
+            strcpy(cc_trace, argv[++k]);
+            udp = 1;
+        } else if (0 == strcmp("-pace", argv[k])) {
+            pacing = 1;
+            udp = 1;
+        } else if (0 == strcmp("-rate", argv[k]) || 0 == strcmp("-total", argv[k])) {
+            if (k + 1 == argc) {
+                fprintf(stderr, "error: need rate in Mbit/s\n");
+                exit(1);
+            }
+            if (atof(argv[k + 1]) <= 0) {
+                fprintf(stderr, "error: illegal rate!\n");
+                exit(1);
+            }
+            //Mbit/s to bytes/us
+            if (0 == strcmp("-rate", argv[k])) {
+                session_rate = atof(argv[++k]) / 8;
+            } else {
+                total_rate = atof(argv[++k]) / 8;
+            }
+            udp = 1;
+        } else if (0 == strcmp("-netem", argv[k])) {
+            if (k + 1 == argc) {
+                fprintf(stderr, "error: need impairment spec\n");
+                exit(1);
+            }
+            if (parseNetem(argv[++k])) {
+                fprintf(stderr, "error: illegal impairment spec!\n");
+                exit(1);
+            }
+            udp = 1;
+        } else if (0 == strcmp("-fec", argv[k])) {
+            if (k + 1 == argc) {
+                fprintf(stderr, "error: need FEC group size\n");
+                exit(1);
+            }
+            if ((fec_group = atoi(argv[++k])) < 1 || fec_group > FEC_GROUP_MAX) {
+                fprintf(stderr, "error: illegal FEC group size!\n");
+                exit(1);
+            }
+            udp = 1;
+        } else if (0 == strcmp("-s", argv[k])) {
+            if (k + 1 == argc) {
+                fprintf(stderr, "error: need datagram size\n");
+                exit(1);
+            }
+            if ((datagram_max = atoi(argv[++k])) < DATAGRAM_MIN || datagram_max > DATAGRAM_MAX) {
+                fprintf(stderr, "error: illegal datagram size!\n");
+                exit(1);
+            }
+            datagram_max &= REQ_SIZE_MASK;
+            udp = 1;
+        } else if (0 == strcmp("-j", argv[k])) {
+            if (k + 1 == argc) {
+                fprintf(stderr, "error: need number of workers\n");
+                exit(1);
+            }
+            if ((workers = atoi(argv[++k])) < 1 || workers > MAX_WORKERS) {
+                fprintf(stderr, "error: illegal number of workers!\n");
+                exit(1);
+            }
+        } else if (0 == strcmp("-pin", argv[k])) {
+            pin_cpu = 1;
+        } else if (0 == strcmp("-hash", argv[k])) {
+            if (k + 1 == argc) {
+                fprintf(stderr, "error: need number of hash threads\n");
+                exit(1);
+            }
+            if ((hash_threads = atoi(argv[++k])) < 1 || hash_threads > MAX_WORKERS) {
+                fprintf(stderr, "error: illegal number of hash threads!\n");
+                exit(1);
+            }
+        } else if (0 == strcmp("-m", argv[k])) {
+            if (k + 1 == argc) {
+                fprintf(stderr, "error: need cache size\n");
+                exit(1);
+            }
+            if ((cache_budget = atol(argv[++k])) < 0) {
+                fprintf(stderr, "error: illegal cache size!\n");
+                exit(1);
+            }
+            cache_budget <<= 20;
         } else if (0 == strcmp("-d", argv[k])) {
             debug_mode = 1;
         } else if (0 == strcmp("-t", argv[k])) {
@@ -669,7 +3162,9 @@ void parseArg(int argc, char * argv[]) {
             }
         }
     }
+    if (udp) {workers = 1;} 
     if (window_size < 1) {window_size = 1;} 
+    if (window_size > CWND_MAX) {window_size = CWND_MAX;} 
     if (msinterval < 1) {msinterval = 1;} 
     if (msinterval > 5000) {msinterval = 5000;} 
     if (port < 10000 || port > 65535) {